@@ -18,9 +18,11 @@
 #include "options.h"
 #include "types.h"
 #include "store.h"
+#include "watch.h"
 
 extern options_t options;
 extern Store*      match_pattern_store;
+extern MAILSTATUS* requested_status;
 extern Passwd*     current_context_passwd;
 
 // Flag saying in critical code
@@ -144,9 +146,18 @@ void mm_lsub (MAILSTREAM *stream,int delimiter,char *name,long attributes) { }
 
 //////////////////////////////////////////////////////////////////////////
 //
-void mm_status (MAILSTREAM *stream,char *mailbox,MAILSTATUS *status) { }
+void mm_status (MAILSTREAM *stream,char *mailbox,MAILSTATUS *status)
+//
+// Gives the status of a mailbox that was asked for or, with NOTIFY,
+// changed. Store::mailbox_status() and --watch want to know.
 //
 //////////////////////////////////////////////////////////////////////////
+{
+  if (requested_status)
+    *requested_status = *status;
+  if (polling_watcher)
+    polling_watcher->status( mailbox, status );
+}
 
 //////////////////////////////////////////////////////////////////////////
 //
@@ -7,6 +7,8 @@
 #include "msgstring.h"
 #include <flstring.h>
 #include "msgid.h"
+#include "msgid_policy.h"
+#include "native_scan.h"
 #include <cassert>
 #include <errno.h>
 
@@ -27,13 +29,167 @@ void Channel::print(FILE* f) {
     print_with_escapes( f, passwd.text );
   }
     if(sizelimit) fprintf( f, "\n\tsizelimit %lu", sizelimit );
+    if(msinfo_format == msinfo_compressed)
+      fprintf( f, "\n\tmsinfo_format compressed" );
     fprintf( f, "\n}\n" );
     return;
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+bool Channel::set_msinfo_format(const string& format)
+//
+// Returns false if "format" is unknown
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (format == "text")
+    msinfo_format = msinfo_text;
+  else if (format == "compressed")
+    msinfo_format = msinfo_compressed;
+  else
+    return false;
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static unsigned long count_msinfo_ids( const char* text, unsigned long textlen,
+                                       unsigned long k)
+//
+// Count the message ids following the mailbox line at "k" in a msinfo body
+// whose newlines have been replaced with '\0'
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long n = 0;
+  for( ; k<textlen && text[k] ; k++);   // skip the mailbox line
+  while ( ++k < textlen && text[k] == '<' ) {
+    n++;
+    for( ; k<textlen && text[k] ; k++);
+  }
+  return n;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool parse_msinfo_tag( const char* entry, string& tag, string& value)
+//
+// Split a "<>, tag: value" line. Message ids in md5 or hash format look
+// alike, but their value is in angle brackets.
+//
+// Returns false if "entry" isn't such a line
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( strncmp( entry, "<>, ", 4) != 0 )
+    return false;
+  const char* colon = strstr( entry + 4, ": ");
+  if ( ! colon || colon[2] == '<' )
+    return false;
+  tag.assign( entry + 4, colon - (entry + 4));
+  value = colon + 2;
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool has_md5_msgids( const char* text, unsigned long textlen,
+                            unsigned long k)
+//
+// Say whether the first message id of the mailbox at "k" has to be
+// migrated from md5 to HASH_MSGID - such mailboxes are never spilled
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  string tag, value;
+  for( ; k<textlen && text[k] ; k++);   // skip the mailbox line
+  while ( k+1 < textlen && parse_msinfo_tag( &text[k+1], tag, value ) )
+    for( k++ ; k<textlen && text[k] ; k++);
+  return options.msgid_type == HASH_MSGID
+         && ++k < textlen && text[k] == '<'
+         && strstr( &text[k], ">, md5: <" );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class Identity>
+bool Channel::parse_lasttime_seen( char* text, unsigned long textlen,
+                                   MsgIdsPerMailbox& mids_per_box, 
+                                   SpilledIdsPerMailbox& spilled,
+                                   MailboxMap& deleted_mailboxes)
+//
+// Parse the body of our msinfo message, whose newlines have been replaced
+// with '\0', see read_lasttime_seen()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long k;
+  string currentbox = "";    // the box whose msg-id's we're currently reading
+  string tag, value;
+  bool instring = 0;
+  SpilledIds* spilling = NULL;       // where the current box goes to
+  // Check each box against `boxes'
+  for ( k=0 ; k<textlen ; ) {
+    if( !instring && text[k] == '\0' ) { // skip nulls, empty mailbox names
+      k++;                               // are allowed so we have to check
+      instring = 1;                      // <- them here
+      continue;
+    }
+    if ( text[k] != '<' ) {
+      if ( spilling && ! spilling->finish( NULL ) )
+        return 0;
+      spilling = NULL;
+      currentbox = &text[k];
+      // if the mailbox is unknown
+      if ( store_a.boxes.find(currentbox) == store_a.boxes.end()
+           && store_b.boxes.find(currentbox) == store_b.boxes.end()) {
+        deleted_mailboxes[currentbox]; //-% creates a new MailboxProperties
+      }
+      else if ( options.max_memory
+                && count_msinfo_ids( text, textlen, k )
+                   > options.max_memory / BYTES_PER_MSGID
+                && ! has_md5_msgids( text, textlen, k ) ) {
+        spilling = new SpilledIds( options.max_memory / 4 );
+        spilled[currentbox] = spilling;
+      }
+    }
+    else if ( parse_msinfo_tag( &text[k], tag, value ) ) {
+      tags_lasttime[currentbox][tag] = value;
+    }
+    else if ( spilling ) {             // it's a message-id of a big box
+      spilling->add( Identity::from_msinfo( &text[k] ), 0 );
+    }
+    else {                             // it's a message-id
+      mids_per_box[currentbox].insert( msgid_table.intern(
+                                    Identity::from_msinfo( &text[k] ) ));
+    }
+    for( ; k<textlen && text[k] ; k++); // fastforward to next string
+    instring = 0;
+  }
+
+  if ( spilling && ! spilling->finish( NULL ) )
+    return 0;
+  return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool Channel::dispatch_parse_lasttime_seen( char* text, unsigned long textlen,
+                                            MsgIdsPerMailbox& mids_per_box, 
+                                            SpilledIdsPerMailbox& spilled,
+                                            MailboxMap& deleted_mailboxes)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  IDENTITY_DISPATCH( parse_lasttime_seen, ( text, textlen, mids_per_box,
+                                            spilled, deleted_mailboxes))
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 bool Channel::read_lasttime_seen( MsgIdsPerMailbox& mids_per_box, 
+                                  SpilledIdsPerMailbox& spilled,
                                   MailboxMap& deleted_mailboxes)
 //
 // Read from msinfo all the message ids that have been seen during the last
@@ -58,6 +214,8 @@ bool Channel::read_lasttime_seen( MsgIdsPerMailbox& mids_per_box,
 //
 //              mids_per_box      - hash of lists with message-ids per mailbox
 //                                  (indexed by mailbox)
+//              spilled           - mailboxes whose message-ids exceed the
+//                                  --max-memory budget and went to disk
 //              deleted_mailboxes - mailboxes that are not contained in the
 //                                  mailboxes set
 //
@@ -67,7 +225,6 @@ bool Channel::read_lasttime_seen( MsgIdsPerMailbox& mids_per_box,
   ENVELOPE* envelope;
   unsigned long msgno;
   unsigned long k;
-  string currentbox = "";    // the box whose msg-id's we're currently reading
   char* text;
   unsigned long textlen;
 
@@ -120,7 +277,18 @@ bool Channel::read_lasttime_seen( MsgIdsPerMailbox& mids_per_box,
       // Found our lasttime
 
       text = mail_fetchtext_full( msinfo_stream, msgno, &textlen, FT_INTERNAL);
-      if ( text )
+      if ( text && is_encoded_msinfo( text, textlen) ) {
+        string plain;
+        if ( ! decode_msinfo( text, textlen, plain) ) {
+          fprintf( stderr, "Error: Couldn't decode body #%lu from msinfo"
+                           " box %s\n", msgno, this->msinfo.c_str() );
+          fprintf( stderr, "       Aborting!\n" );
+          return 0;
+        }
+        text = strdup( plain.c_str() );
+        textlen = plain.length();
+      }
+      else if ( text )
         text = strdup( text );
       else {
         fprintf( stderr, "Error: Couldn't fetch body #%lu from msinfo box %s\n",
@@ -135,30 +303,11 @@ bool Channel::read_lasttime_seen( MsgIdsPerMailbox& mids_per_box,
         if ( text[k] == '\n' )    // can we assume that newlines are allways \n?
           text[k] = '\0';
       }
-      bool instring = 0;
-      // Check each box against `boxes'
-      for ( k=0 ; k<textlen ; ) {
-        if( !instring && text[k] == '\0' ) { // skip nulls, empty mailbox names
-          k++;                               // are allowed so we have to check
-          instring = 1;                      // <- them here
-          continue;
-        }
-        if ( text[k] != '<' ) {
-          currentbox = &text[k];
-          // if the mailbox is unknown
-          if ( store_a.boxes.find(currentbox) == store_a.boxes.end()
-               && store_b.boxes.find(currentbox) == store_b.boxes.end()) {
-            deleted_mailboxes[currentbox]; //-% creates a new MailboxProperties
-          }
-        }
-        else {                             // it's a message-id
-          mids_per_box[currentbox].insert(
-                                      MsgId( &text[k] ).from_msinfo_format() );
-        }
-        for( ; k<textlen && text[k] ; k++); // fastforward to next string
-        instring = 0;
+      if ( ! dispatch_parse_lasttime_seen( text, textlen, mids_per_box,
+                                           spilled, deleted_mailboxes ) ) {
+        free( text );
+        return 0;
       }
-
       free( text );
       break;    // Stop searching for message
     }
@@ -221,10 +370,146 @@ bool Channel::open_for_copying( string mailbox_name,
   } else {
     mail_close( store_to.stream );
     store_to.stream = NIL;
+    // local maildirs are written without c-client, see MaildirWriter
+    string path;
+    if ( local_mailbox_path( store_to.full_mailbox_name( mailbox_name ), path )
+         && is_maildir( path ) )
+      maildir_writer = new MaildirWriter( path );
+    // other local mailboxes get all messages in one mail_append_multiple,
+    // see finish_copying()
+    else {
+      append_queued = true;
+      queued_mailbox = mailbox_name;
+      queued_direction = direction;
+    }
   }
   return 1;
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+bool Channel::queue_for_maildir( Store& store_from, unsigned long msgno,
+                                 const MsgId& msgid)
+//
+// Hand message "msgno" of "store_from" to the MaildirWriter of the target
+// mailbox. It's delivered together with the following ones, see
+// finish_copying()
+//
+// Returns false if the message couldn't be fetched
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long header_len, text_len;
+  char* header = mail_fetchheader_full( store_from.stream, msgno, NIL,
+                                        &header_len, FT_PEEK );
+  if (! header)
+    return 0;
+  string message( header, header_len );
+  char* text = mail_fetchtext_full( store_from.stream, msgno, &text_len,
+                                    FT_PEEK );
+  if (! text)
+    return 0;
+  message.append( text, text_len );
+
+  // c-client hands out CRLF, maildirs hold LF
+  string::size_type to = 0;
+  for ( string::size_type from = 0; from < message.length(); from++ )
+    if ( message[from] != '\r' || from + 1 == message.length()
+         || message[from+1] != '\n' )
+      message[to++] = message[from];
+  message.resize( to );
+
+  MESSAGECACHE* elt = mail_elt( store_from.stream, msgno );
+  string info = ":2,";
+  if (elt->draft)    info += 'D';
+  if (elt->flagged)  info += 'F';
+  if (elt->answered) info += 'R';
+  if (elt->seen)     info += 'S';
+  if (elt->deleted)  info += 'T';
+
+  maildir_writer->add_message( message, info, mail_longdate( elt ) );
+  queued.push_back( msgid );
+  if ( maildir_writer->batch_full() )
+    commit_deliveries();
+  return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void Channel::commit_deliveries()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (! maildir_writer->commit() )
+    failed_deliveries.insert( failed_deliveries.end(),
+                              queued.begin(), queued.end() );
+  queued.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void Channel::queue_for_append( unsigned long msgno, const MsgId& msgid)
+//
+// Remember message "msgno" to be appended to the local target mailbox by
+// finish_copying()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  queued_msgnos.push_back( msgno );
+  queued.push_back( msgid );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+unsigned long Channel::finish_copying( vector<MsgId>& failed)
+//
+// Deliver the messages still queued for a local mailbox. Messages of a
+// batch that couldn't be delivered - may be only in part - are added to
+// "failed", they're rediscovered next time.
+//
+// Returns the number of messages copy_message() and append_messages()
+// took to be copied, but which failed
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( maildir_writer ) {
+    commit_deliveries();
+    delete maildir_writer;
+    maildir_writer = NULL;
+  }
+  else if ( append_queued ) {
+    append_queued_messages();
+    append_queued = false;
+  }
+  else
+    return 0;
+  unsigned long n = failed_deliveries.size();
+  failed.insert( failed.end(), failed_deliveries.begin(),
+                 failed_deliveries.end() );
+  failed_deliveries.clear();
+  return n;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void message_flags( MESSAGECACHE* elt, char* flags)
+//
+// Writes the flags of "elt" to "flags" as expected by mail_append_full,
+// with a leading blank. "flags" must hold MAILTMPLEN characters
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  memset( flags, 0, MAILTMPLEN );
+  if (elt->seen)     strcat (flags," \\Seen");
+  // why doesn't the following work?
+  // else
+  //                   strcat (flags," \\New");
+  if (elt->deleted)  strcat (flags," \\Deleted");
+  if (elt->flagged)  strcat (flags," \\Flagged");
+  if (elt->answered) strcat (flags," \\Answered");
+  if (elt->draft)    strcat (flags," \\Draft");
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 bool Channel::copy_message( unsigned long msgno,
@@ -270,7 +555,7 @@ bool Channel::copy_message( unsigned long msgno,
   }
 
   // Check message-id.
-  msgid_fetched = MsgId(envelope);
+  msgid_fetched = MsgId( store_from.stream, msgno, envelope);
   if (msgid_fetched.length() == 0) {
     printf( "Warning: missing message-id from mailbox %s, message #%lu.\n",
             store_from.stream->mailbox, msgno);
@@ -282,7 +567,7 @@ bool Channel::copy_message( unsigned long msgno,
       printf( "Warning: suspicious message-id from mailbox %s, message #%lu.",
               store_from.stream->mailbox, msgno);
       printf( "         msgid expected: %s, msgid found: %s. \n",
-              msgid.c_str(), msgid_fetched.c_str());
+              msgid.printable().c_str(), msgid_fetched.printable().c_str());
       printf( "Please report this to http://sourceforge.net/tracker/"
               "?group_id=6374&atid=106374\n");
     }
@@ -299,22 +584,14 @@ bool Channel::copy_message( unsigned long msgno,
     print_lead( "ign. del" , direction == a_to_b ? " >" : "< " );
     print_from( store_from.stream, msgno );
     if ( options.show_message_id ) {
-      print_msgid( msgid.c_str() );
+      print_msgid( msgid.printable().c_str() );
     }
     printf("\n");
     return 0;
   }
       
   // Copy message over with all the flags that the original has
-  memset( flags, 0, MAILTMPLEN );
-  if (elt->seen)     strcat (flags," \\Seen");
-  // why doesn't the following work?
-  // else
-  //                   strcat (flags," \\New");
-  if (elt->deleted)  strcat (flags," \\Deleted");
-  if (elt->flagged)  strcat (flags," \\Flagged");
-  if (elt->answered) strcat (flags," \\Answered");
-  if (elt->draft)    strcat (flags," \\Draft");
+  message_flags( elt, flags );
 
   msgdata.stream = store_from.stream;
   msgdata.msgno = msgno;
@@ -324,7 +601,7 @@ bool Channel::copy_message( unsigned long msgno,
     print_lead( "too big" , direction == a_to_b ? "->" : "<-" );
     print_from( store_from.stream, msgno );
     if ( options.show_message_id ) {
-      print_msgid( msgid.c_str() );
+      print_msgid( msgid.printable().c_str() );
     }
     printf("\n");
     return 0;
@@ -332,7 +609,13 @@ bool Channel::copy_message( unsigned long msgno,
   INIT ( &CCstring, msg_string, (void*) &msgdata, elt->rfc822_size );
   current_context_passwd = &store_to.passwd;
 
-  if (!options.simulate) 
+  if (options.simulate)
+    ;
+  else if (maildir_writer)
+    success = queue_for_maildir( store_from, msgno, msgid );
+  else if (append_queued)
+    queue_for_append( msgno, msgid );
+  else
     success = mail_append_full( store_to.stream,
                                 nccs( store_to.full_mailbox_name(mailbox_name)),
                                 &flags[1], mail_date(msgdate,elt), 
@@ -342,7 +625,7 @@ bool Channel::copy_message( unsigned long msgno,
                 direction == a_to_b ? "->" : "<-" );
     print_from( store_from.stream, msgno );
     if (options.show_message_id)
-      print_msgid( msgid.c_str() );
+      print_msgid( msgid.printable().c_str() );
     printf("\n");
   }
 
@@ -351,10 +634,230 @@ bool Channel::copy_message( unsigned long msgno,
   return success;
 }
 
+// State of a batch of messages handed to mail_append_multiple
+struct AppendBatch
+{
+  MAILSTREAM* stream;
+  const vector<unsigned long>* msgnos;
+  vector<bool>* appended;
+  unsigned long next;
+  unsigned long sizelimit;
+  MSGDATA msgdata;
+  STRING message;
+  char flags[MAILTMPLEN];
+  char date[MAILTMPLEN];
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+static long next_message_to_append( MAILSTREAM* stream, void* data,
+                                    char** flags, char** date,
+                                    STRING** message)
+//
+// Callback of mail_append_multiple. Hands over the next message of the
+// batch, skipping deleted messages - unless copying them is demanded - and
+// messages above the size limit. *message is NIL at the end of the batch
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  AppendBatch* batch = (AppendBatch*) data;
+  *message = NIL;
+  while ( batch->next < batch->msgnos->size() ) {
+    unsigned long n = batch->next++;
+    unsigned long msgno = (*batch->msgnos)[n];
+    MESSAGECACHE* elt = mail_elt( batch->stream, msgno );
+    if ( (elt->deleted && ! options.copy_deleted_messages)
+         || (batch->sizelimit && elt->rfc822_size > batch->sizelimit) )
+      continue;
+    message_flags( elt, batch->flags );
+    batch->msgdata.stream = batch->stream;
+    batch->msgdata.msgno = msgno;
+    INIT( &batch->message, msg_string, (void*) &batch->msgdata,
+          elt->rfc822_size );
+    *flags = &batch->flags[1];
+    *date = mail_date( batch->date, elt );
+    *message = &batch->message;
+    (*batch->appended)[n] = true;
+    break;
+  }
+  return T;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool Channel::append_messages( const vector<unsigned long>& msgnos,
+                               const vector<MsgId>& msgids,
+                               string mailbox_name,
+                               enum direction_t direction,
+                               vector<bool>& appended)
+//
+// Copies the messages "msgnos" from one store to the other depending on
+// "direction" in one go, for the initial sync of a mailbox. Unlike
+// copy_message the message-ids aren't checked again. Deleted messages
+// and messages that are too big are skipped just the same. The flags,
+// sizes and dates of the messages must have been fetched already.
+//
+// "appended" tells which of the messages were copied. If the store
+// refuses the batch none are taken to be.
+//
+// Returns false if the batch failed
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Store& store_from = (direction == a_to_b) ? store_a : store_b;
+  Store& store_to   = (direction == a_to_b) ? store_b : store_a;
+  AppendBatch batch;
+
+  appended.assign( msgnos.size(), false );
+  if ( msgnos.empty() )
+    return true;
+
+  batch.stream = store_from.stream;
+  batch.msgnos = &msgnos;
+  batch.appended = &appended;
+  batch.next = 0;
+  batch.sizelimit = this->sizelimit;
+
+  bool success = true;
+  if (! options.simulate && ! maildir_writer && ! append_queued ) {
+    current_context_passwd = &store_to.passwd;
+    success = mail_append_multiple( store_to.stream,
+                                  nccs( store_to.full_mailbox_name(mailbox_name)),
+                                  next_message_to_append, &batch );
+  }
+  else
+    while ( batch.next < msgnos.size() ) {
+      STRING* message;
+      char* flags;
+      char* date;
+      next_message_to_append( NIL, &batch, &flags, &date, &message );
+      unsigned long n = batch.next - 1;
+      if (! message || options.simulate )
+        ;
+      else if ( maildir_writer ) {
+        if (! queue_for_maildir( store_from, msgnos[n], msgids[n] ) )
+          appended[n] = false;
+      }
+      else
+        queue_for_append( msgnos[n], msgids[n] );
+    }
+  if (! success )
+    appended.assign( msgnos.size(), false );
+
+  for ( unsigned long n = 0; n < msgnos.size(); n++ ) {
+    if (! options.show_from )
+      break;
+    print_lead( appended[n] ? "copied" : success ? "skipped" : "copyfail",
+                direction == a_to_b ? "->" : "<-" );
+    print_from( store_from.stream, msgnos[n] );
+    printf("\n");
+  }
+  return success;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void Channel::append_queued_messages()
+//
+// Append all messages queued for a local mailbox with one call of
+// mail_append_multiple. For an mbox c-client then writes them to a
+// temporary file, takes its usual locks on the mailbox once, appends
+// that file, fsyncs once and unlocks - instead of doing all that for
+// every single message. If anything goes wrong the mailbox is truncated
+// to its former size, so all of the messages failed.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (! queued_msgnos.empty() ) {
+    Store& store_from = (queued_direction == a_to_b) ? store_a : store_b;
+    Store& store_to   = (queued_direction == a_to_b) ? store_b : store_a;
+    vector<bool> appended( queued_msgnos.size(), false );
+    AppendBatch batch;
+    batch.stream = store_from.stream;
+    batch.msgnos = &queued_msgnos;
+    batch.appended = &appended;
+    batch.next = 0;
+    batch.sizelimit = this->sizelimit;
+
+    current_context_passwd = &store_to.passwd;
+    if (! mail_append_multiple( store_to.stream,
+                          nccs( store_to.full_mailbox_name(queued_mailbox)),
+                          next_message_to_append, &batch ) ) {
+      fprintf( stderr, "Error: Couldn't append %lu messages to mailbox %s\n",
+                       (unsigned long) queued_msgnos.size(),
+                       queued_mailbox.c_str() );
+      failed_deliveries.insert( failed_deliveries.end(),
+                                queued.begin(), queued.end() );
+    }
+  }
+  queued_msgnos.clear();
+  queued.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static SetDigest digest_of( const MsgIdSet& msgids)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  SetDigest digest;
+  for ( MsgIdSet::const_iterator i = msgids.begin(); i != msgids.end(); i++)
+    digest.add( msgid_table.hash( *i ));
+  return digest;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static SetDigest digest_of( const SpilledIds& msgids)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  SetDigest digest;
+  for ( SpilledIds::Cursor i( msgids ); ! i.done(); i.next() )
+    digest.add( hash_msgid( i.key().data(), i.key().length() ));
+  return digest;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void Channel::msinfo_tag_lines( const string& mailbox,
+                                const SetDigest& digest,
+                                vector<string>& lines)
+//
+// Return the "<>, tag: value" lines to be written for "mailbox": its
+// digest and whatever was put into tags_thistime
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MsinfoTags& tags = tags_thistime[mailbox];
+  tags["digest"] = digest.to_string();
+  for ( MsinfoTags::const_iterator i = tags.begin(); i != tags.end(); i++)
+    lines.push_back( "<>, " + i->first + ": " + i->second );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool Channel::lasttime_digest( const string& mailbox, SetDigest& digest)
+//
+// Get the digest of the message ids of "mailbox" stored in msinfo at the
+// last sync
+//
+// Returns false if there is none
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MsinfoTagsPerMailbox::iterator tags = tags_lasttime.find( mailbox );
+  if ( tags == tags_lasttime.end() )
+    return false;
+  MsinfoTags::iterator tag = tags->second.find( "digest" );
+  return tag != tags->second.end() && digest.from_string( tag->second );
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 bool Channel::write_thistime_seen( const MailboxMap& deleted_mailboxes,
-                                         MsgIdsPerMailbox& thistime)
+                                         MsgIdsPerMailbox& thistime,
+                                   const SpilledIdsPerMailbox& spilled)
 //
 // Save in channel.msinfo all mailboxes with all msgids (found in
 // "thistime") they contain.
@@ -362,6 +865,7 @@ bool Channel::write_thistime_seen( const MailboxMap& deleted_mailboxes,
 // deleted_mailboxes  - the mailboxes that were deleted since the last sync
 // thistime           - hash indexed by mailbox name containing a list of
 //                      msgids for each box
+// spilled            - same for the boxes that were synced out of core
 //
 // returns !0 on success
 //
@@ -420,16 +924,58 @@ bool Channel::write_thistime_seen( const MailboxMap& deleted_mailboxes,
     // for each box - if it's not a deleted mailbox:
     // * first write a line containing it's name
     // * then dump all the message-id's we've seen the last time into it
+    MsinfoSections sections;
     for ( MsgIdsPerMailbox::const_iterator mailbox = thistime.begin() ;
           mailbox != thistime.end() ;
           mailbox++)
     {
       if ( deleted_mailboxes.find(mailbox->first)
-           == deleted_mailboxes.end()) { // not found
+           != deleted_mailboxes.end()) // found
+        continue;
+      vector<string> tag_lines;
+      msinfo_tag_lines( mailbox->first, digest_of( mailbox->second ),
+                        tag_lines );
+      if ( msinfo_format == msinfo_compressed ) {
+        sections.push_back( MsinfoSection( mailbox->first, tag_lines));
+        msinfo_entries( mailbox->second, sections.back().second );
+      }
+      else {
         fprintf( f, "%s\n", mailbox->first.c_str() );
+        for ( unsigned i = 0; i < tag_lines.size(); i++ )
+          fprintf( f, "%s\n", tag_lines[i].c_str() );
         print_list_with_delimiter( thistime[ mailbox->first ], f, "\n");
       }
     }
+    for ( SpilledIdsPerMailbox::const_iterator mailbox = spilled.begin() ;
+          mailbox != spilled.end() ;
+          mailbox++)
+    {
+      if ( deleted_mailboxes.find(mailbox->first)
+           != deleted_mailboxes.end()) // found
+        continue;
+      // the spilled ids are sorted by message id, not by their msinfo
+      // format, which only matters to the compressed encoding
+      vector<string> tag_lines;
+      msinfo_tag_lines( mailbox->first, digest_of( *mailbox->second ),
+                        tag_lines );
+      if ( msinfo_format == msinfo_compressed ) {
+        sections.push_back( MsinfoSection( mailbox->first, tag_lines));
+        msinfo_entries( *mailbox->second, sections.back().second );
+      }
+      else {
+        fprintf( f, "%s\n", mailbox->first.c_str() );
+        for ( unsigned i = 0; i < tag_lines.size(); i++ )
+          fprintf( f, "%s\n", tag_lines[i].c_str() );
+        print_msinfo_entries( *mailbox->second, f );
+      }
+    }
+    if ( msinfo_format == msinfo_compressed
+         && ! write_encoded_msinfo( f, sections ) )
+    {
+      fclose(f);
+      mail_close(msinfo_stream);
+      return 0;
+    }
 
     // append the constructed email into the msinfo box
     flen = ftell(f);
@@ -4,9 +4,15 @@
 #include <string>
 #include "types.h"      // Passwd
 #include "store.h"
+#include "maildir.h"
+#include "msinfo_encoding.h"
 
 enum direction_t { a_to_b, b_to_a };
 
+// Per mailbox information stored in msinfo as "<>, tag: value" lines
+typedef map<string, string> MsinfoTags;                 // tag -> value
+typedef map<string, MsinfoTags> MsinfoTagsPerMailbox;
+
 //////////////////////////////////////////////////////////////////////////
 //
 class Channel
@@ -20,10 +26,17 @@ class Channel
     Store store_a;
     Store store_b;
     string msinfo;
+    msinfo_format_t msinfo_format;   // how to write msinfo
     Passwd passwd;
     unsigned long sizelimit;
+    MsinfoTagsPerMailbox tags_lasttime;  // as read from msinfo
+    MsinfoTagsPerMailbox tags_thistime;  // to be written to msinfo
 
-    Channel(): name(), msinfo(), passwd(), sizelimit(0) {};
+    Channel(): name(), msinfo(), msinfo_format(msinfo_text), passwd(),
+               sizelimit(0), tags_lasttime(), tags_thistime(),
+               maildir_writer(NULL), append_queued(false), queued_msgnos(),
+               queued_mailbox(), queued_direction(a_to_b), queued(),
+               failed_deliveries() {};
 
     void print(FILE* f);
 
@@ -32,15 +45,52 @@ class Channel
     {
       sizelimit=strtoul(sizelim.c_str(),NULL,10);
     }
+    bool set_msinfo_format(const string& format);
     bool read_lasttime_seen( MsgIdsPerMailbox& mids_per_box, 
+                             SpilledIdsPerMailbox& spilled,
                              MailboxMap& deleted_mailboxes);
     bool open_for_copying( string mailbox_name, enum direction_t direction);
     bool copy_message( unsigned long msgno,
                        const MsgId& msgid,
                        string mailbox_name,
                        enum direction_t direction);
+    bool append_messages( const vector<unsigned long>& msgnos,
+                          const vector<MsgId>& msgids,
+                          string mailbox_name,
+                          enum direction_t direction,
+                          vector<bool>& appended);
+    unsigned long finish_copying( vector<MsgId>& failed);
     bool write_thistime_seen( const MailboxMap& deleted_mailboxes,
-                                    MsgIdsPerMailbox& thistime);
+                                    MsgIdsPerMailbox& thistime,
+                              const SpilledIdsPerMailbox& spilled);
+    bool lasttime_digest( const string& mailbox, SetDigest& digest);
+
+  private:
+    MaildirWriter* maildir_writer;       // when copying into a local maildir
+    bool append_queued;                  // when copying into another local
+                                         // mailbox, e.g. an mbox
+    vector<unsigned long> queued_msgnos; // in the store copied from
+    string queued_mailbox;
+    enum direction_t queued_direction;
+    vector<MsgId> queued;                // messages not committed yet
+    vector<MsgId> failed_deliveries;     // committed in vain
+
+    bool queue_for_maildir( Store& store_from, unsigned long msgno,
+                            const MsgId& msgid);
+    void commit_deliveries();
+    void queue_for_append( unsigned long msgno, const MsgId& msgid);
+    void append_queued_messages();
+    template <class Identity>
+    bool parse_lasttime_seen( char* text, unsigned long textlen,
+                              MsgIdsPerMailbox& mids_per_box,
+                              SpilledIdsPerMailbox& spilled,
+                              MailboxMap& deleted_mailboxes);
+    bool dispatch_parse_lasttime_seen( char* text, unsigned long textlen,
+                                       MsgIdsPerMailbox& mids_per_box,
+                                       SpilledIdsPerMailbox& spilled,
+                                       MailboxMap& deleted_mailboxes);
+    void msinfo_tag_lines( const string& mailbox, const SetDigest& digest,
+                           vector<string>& lines);
 };
 
 #define __MAILSYNC_CHANNEL__
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include "classify.h"
+
+//////////////////////////////////////////////////////////////////////////
+//
+class SortedIds
+//
+// Source for classify_merge reading from a sorted vector
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    SortedIds( const vector<MsgIdHandle>& v): ids(v), pos(0) {}
+    bool done() const        { return pos == ids.size(); }
+    MsgIdHandle key() const  { return ids[pos]; }
+    void next()              { pos++; }
+  private:
+    const vector<MsgIdHandle>& ids;
+    size_t pos;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+void classify( const vector<MsgIdHandle>& lasttime,
+               const vector<MsgIdHandle>& a,
+               const vector<MsgIdHandle>& b,
+               Classification& result)
+//
+// Classify the message ids of a mailbox. All three inputs must be sorted
+// and free of duplicates.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  SortedIds l_ids( lasttime), a_ids( a), b_ids( b);
+
+  result.now.reserve( max( a.size(), b.size()));
+  classify_merge( l_ids, a_ids, b_ids, result);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void classify( const SpilledIds& lasttime,
+               const SpilledIds& a,
+               const SpilledIds& b,
+               SpilledClassification& result)
+//
+// Same as above for spilled message ids. Only one record per file is held
+// in memory at any time.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  SpilledIds::Cursor l_ids( lasttime), a_ids( a), b_ids( b);
+
+  classify_merge( l_ids, a_ids, b_ids, result);
+}
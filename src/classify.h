@@ -0,0 +1,197 @@
+#ifndef __MAILSYNC_CLASSIFY__
+
+#include <vector>
+#include "msgid_table.h"
+#include "spill.h"
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Three way classification of the messages of one mailbox
+//
+// Each message id that was seen last time, or is seen now in store_a or
+// in store_b, is classified by where it is present:
+//
+//  a b l
+//  x - -     New message on a            -> copy a to b
+//  - x -     New message on b            -> copy b to a
+//  x x x     Kept message
+//  x x -     New message, present in a and b, no copying necessary
+//  x - x     Deleted on b                -> remove from a
+//  - x x     Deleted on a                -> remove from b
+//  - - x     Deleted on both
+//
+// When mirroring a to b (--mirror) nothing is copied to or removed from a:
+//
+//  - x -     New message on b            -> left alone and forgotten
+//  x - x     Lost on b                   -> copy a to b again
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class Source, class Sink>
+void classify_merge( Source& lasttime, Source& a, Source& b, Sink& sink)
+//
+// Classify the ids of three sorted and duplicate free sources in a single
+// merge pass
+//
+// A Source has done(), key() and next() and keys that can be ordered by
+// "<". The Sink is called with the source the message was found in:
+//
+// new_on_a(a), new_on_b(b), kept(a), deleted_on_b(a), deleted_on_a(b)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  while (! (lasttime.done() && a.done() && b.done())) {
+    // find the smallest id that any of the sources is positioned on
+    Source* smallest = NULL;
+    if (! lasttime.done())
+      smallest = &lasttime;
+    if (! a.done() && (! smallest || a.key() < smallest->key()))
+      smallest = &a;
+    if (! b.done() && (! smallest || b.key() < smallest->key()))
+      smallest = &b;
+
+    bool in_l = ! lasttime.done() && ! (smallest->key() < lasttime.key());
+    bool in_a = ! a.done()        && ! (smallest->key() < a.key());
+    bool in_b = ! b.done()        && ! (smallest->key() < b.key());
+
+    if (in_a && ! in_b) {
+      if (in_l) sink.deleted_on_b( a );
+      else      sink.new_on_a( a );
+    }
+    else if (in_b && ! in_a) {
+      if (in_l) sink.deleted_on_a( b );
+      else      sink.new_on_b( b );
+    }
+    else if (in_a && in_b)
+      sink.kept( a );
+    // else: deleted on both
+
+    if (in_l) lasttime.next();
+    if (in_a) a.next();
+    if (in_b) b.next();
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+struct Classification
+//
+// The result of classifying a mailbox
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  vector<MsgIdHandle> copy_a_b;         // new on a
+  vector<MsgIdHandle> copy_b_a;         // new on b
+  vector<MsgIdHandle> remove_a;         // deleted on b
+  vector<MsgIdHandle> remove_b;         // deleted on a
+  vector<MsgIdHandle> now;              // messages that remain, sorted
+  bool mirror;                          // a to b only
+
+  Classification(): copy_a_b(), copy_b_a(), remove_a(), remove_b(), now(),
+                    mirror(false) {}
+
+  template <class Source> void new_on_a( const Source& a)
+  {
+    copy_a_b.push_back( a.key());
+    now.push_back( a.key());
+  }
+  template <class Source> void new_on_b( const Source& b)
+  {
+    if (mirror)
+      return;
+    copy_b_a.push_back( b.key());
+    now.push_back( b.key());
+  }
+  template <class Source> void kept( const Source& a)
+  {
+    now.push_back( a.key());
+  }
+  template <class Source> void deleted_on_b( const Source& a)
+  {
+    if (mirror)
+      new_on_a( a);
+    else
+      remove_a.push_back( a.key());
+  }
+  template <class Source> void deleted_on_a( const Source& b)
+  {
+    remove_b.push_back( b.key());
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+struct SpilledClassification
+//
+// The result of classifying a mailbox out of core. The lists are appended
+// to in sorted order and carry the message numbers along. "now" is
+// allocated by the caller, as it outlives the rest of the classification.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  SpilledIds copy_a_b, copy_b_a, remove_a, remove_b;
+  SpilledIds& now;
+  bool mirror;                          // a to b only
+
+  SpilledClassification( size_t chunk_size, SpilledIds& remaining):
+    copy_a_b(chunk_size), copy_b_a(chunk_size), remove_a(chunk_size),
+    remove_b(chunk_size), now(remaining), mirror(false) {}
+
+  template <class Source> void new_on_a( const Source& a)
+  {
+    copy_a_b.append( a.key(), a.msgno());
+    now.append( a.key(), 0);
+  }
+  template <class Source> void new_on_b( const Source& b)
+  {
+    if (mirror)
+      return;
+    copy_b_a.append( b.key(), b.msgno());
+    now.append( b.key(), 0);
+  }
+  template <class Source> void kept( const Source& a)
+  {
+    now.append( a.key(), 0);
+  }
+  template <class Source> void deleted_on_b( const Source& a)
+  {
+    if (mirror)
+      new_on_a( a);
+    else
+      remove_a.append( a.key(), a.msgno());
+  }
+  template <class Source> void deleted_on_a( const Source& b)
+  {
+    remove_b.append( b.key(), b.msgno());
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+void classify( const vector<MsgIdHandle>& lasttime,
+               const vector<MsgIdHandle>& a,
+               const vector<MsgIdHandle>& b,
+               Classification& result);
+//
+// Classify the message ids of a mailbox. All three inputs must be sorted
+// and free of duplicates.
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+void classify( const SpilledIds& lasttime,
+               const SpilledIds& a,
+               const SpilledIds& b,
+               SpilledClassification& result);
+//
+// Same as above for spilled message ids, see --max-memory
+//
+//////////////////////////////////////////////////////////////////////////
+
+#define __MAILSYNC_CLASSIFY__
+#endif
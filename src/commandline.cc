@@ -1,5 +1,7 @@
 #include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <string>
 #include <map>
 #include <vector>
@@ -8,6 +10,7 @@
 #include "store.h"
 #include "channel.h"
 #include "configuration.h"
+#include "spill.h"             // BYTES_PER_MSGID
 
 extern options_t options;
 
@@ -44,11 +47,51 @@ void usage()
   printf("  -vw      show warnings\n");
   printf("  -vp      show RFC 822 parsing errors\n");
   printf("  -f conf  use alternate config file\n");
-  printf("  -t [msgid|md5] msg id type\n");
+  printf("  -t [msgid|md5|hash] msg id type\n");
+  printf("  --max-memory size[k|M|G]\n");
+  printf("           sync mailboxes whose message ids need more memory than\n");
+  printf("           that out of core\n");
+  printf("  --plan-out file\n");
+  printf("           save what a sync would do to file instead of doing it\n");
+  printf("  --plan-in file\n");
+  printf("           do what was saved with --plan-out, without scanning\n");
+  printf("  --mirror mirror the first store of the channel to the second one,\n");
+  printf("           which is only scanned now and then\n");
+  printf("  --verify with --mirror: scan the second store this time\n");
+  printf("  --adopt  take the messages found in both stores as synced and\n");
+  printf("           report the others, without copying or deleting anything\n");
+  printf("  --watch  keep running and sync local maildirs and mbox files again\n");
+  printf("           whenever they change\n");
   printf("\n");
   return;
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+static bool parse_size( const char* arg, unsigned long& size)
+//
+// Parse a size in bytes with an optional k, M or G suffix
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  char* end;
+  unsigned long n = strtoul( arg, &end, 10);
+  unsigned long unit = 1;
+
+  if (end == arg)
+    return false;
+  switch (*end) {
+    case 'k': case 'K': unit = 1024; end++; break;
+    case 'm': case 'M': unit = 1024*1024; end++; break;
+    case 'g': case 'G': unit = 1024*1024*1024; end++; break;
+  }
+  if (*end || n == 0 || n > ULONG_MAX / unit
+      || n * unit < 4 * BYTES_PER_MSGID)
+    return false;
+  size = n * unit;
+  return true;
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 // const impossible here? (tpo)               vvvv
@@ -85,7 +128,6 @@ bool read_commandline_options( const int argc,
     case 's':
       printf("Only simulating\n");
       options.simulate = 1;
-      options.delete_messages = 0;
       break;
     case 'v':
       if (argv[optind][2] == 'b')
@@ -132,12 +174,40 @@ bool read_commandline_options( const int argc,
       }
       else if ( strcmp( argv[optind], "msgid" ) == 0 )
         options.msgid_type = HEADER_MSGID;
+      else if ( strcmp( argv[optind], "hash" ) == 0 )
+        options.msgid_type = HASH_MSGID;
       else {
         usage();
         printf("Error: unknown message id format\n");
         return false;
       }
       break;
+    case '-':
+      if ( strcmp( argv[optind], "--max-memory") == 0 && optind+1 < argc ) {
+        if (! parse_size( argv[++optind], options.max_memory)) {
+          usage();
+          printf("Error: invalid size \"%s\" for --max-memory\n",
+                 argv[optind]);
+          return false;
+        }
+      }
+      else if ( strcmp( argv[optind], "--plan-out") == 0 && optind+1 < argc )
+        options.plan_out = argv[++optind];
+      else if ( strcmp( argv[optind], "--plan-in") == 0 && optind+1 < argc )
+        options.plan_in = argv[++optind];
+      else if ( strcmp( argv[optind], "--mirror") == 0 )
+        options.mirror = 1;
+      else if ( strcmp( argv[optind], "--verify") == 0 )
+        options.verify = 1;
+      else if ( strcmp( argv[optind], "--adopt") == 0 )
+        options.adopt = 1;
+      else if ( strcmp( argv[optind], "--watch") == 0 )
+        options.watch = 1;
+      else {
+        usage();
+        return false;
+      }
+      break;
     default:
       usage();
       return false;
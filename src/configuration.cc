@@ -247,6 +247,11 @@ void parse_config(FILE* f, map<string, ConfigItem>& confmap)
           get_token(f, t);
 	  channel->set_sizelimit(t->buf);
 	}
+        else if (t->buf == "msinfo_format") {
+          get_token(f, t);
+          if (! channel->set_msinfo_format(t->buf))
+            die_with_fatal_parse_error(t, "Unknown msinfo_format");
+        }
         else
           die_with_fatal_parse_error(t, "Unknown channel field");
       }
@@ -6,12 +6,77 @@
 #include "msgstring.h"
 #include "utils.h"
 #include "flstring.h"
+#include "msgid_table.h"
+#include "msgid_policy.h"
+#include "spill.h"
+#include <vector>
+#include <algorithm>
 
 extern options_t options;
 extern Passwd*     current_context_passwd;
 
 //------------------------- Helper functions -----------------------------
 
+//////////////////////////////////////////////////////////////////////////
+//
+template <class Identity>
+void msinfo_entries( const MsgIdSet& msgIds, vector<string>& entries)
+//
+// Return the message ids in "msgIds" in msinfo format sorted
+// alphabetically
+//
+// The sets are ordered by handle, sorting keeps msinfo stable between
+// runs and helps the compressed msinfo encoding
+// 
+//////////////////////////////////////////////////////////////////////////
+{
+    entries.reserve( entries.size() + msgIds.size());
+    for ( MsgIdSet::const_iterator msgId = msgIds.begin() ;
+          msgId != msgIds.end() ;
+          msgId++ )
+    {
+      entries.push_back( Identity::to_msinfo( msgid_table.msgid( *msgId )));
+    }
+    sort( entries.begin(), entries.end());
+}
+
+void msinfo_entries( const MsgIdSet& msgIds, vector<string>& entries)
+{
+  IDENTITY_DISPATCH( msinfo_entries, ( msgIds, entries))
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class Identity>
+void msinfo_entries( const SpilledIds& msgIds, vector<string>& entries)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+    entries.reserve( entries.size() + msgIds.size());
+    for ( SpilledIds::Cursor msgId( msgIds ); ! msgId.done(); msgId.next() )
+      entries.push_back( Identity::to_msinfo( msgId.key() ));
+}
+
+void msinfo_entries( const SpilledIds& msgIds, vector<string>& entries)
+{
+  IDENTITY_DISPATCH( msinfo_entries, ( msgIds, entries))
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class Identity>
+void print_msinfo_entries( const SpilledIds& msgIds, FILE* f)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+    for ( SpilledIds::Cursor msgId( msgIds ); ! msgId.done(); msgId.next() )
+      fprintf( f, "%s\n", Identity::to_msinfo( msgId.key() ).c_str());
+}
+
+void print_msinfo_entries( const SpilledIds& msgIds, FILE* f)
+{
+  IDENTITY_DISPATCH( print_msinfo_entries, ( msgIds, f))
+}
 
 //////////////////////////////////////////////////////////////////////////
 //
@@ -24,14 +89,14 @@ void print_list_with_delimiter( const MsgIdSet& msgIds,
 // 
 //////////////////////////////////////////////////////////////////////////
 {
-    MsgId tmp_msgId;
+    vector<string> entries;
 
-    for ( MsgIdSet::iterator msgId = msgIds.begin() ;
-          msgId != msgIds.end() ;
-          msgId++ )
+    msinfo_entries( msgIds, entries);
+    for ( vector<string>::iterator entry = entries.begin() ;
+          entry != entries.end() ;
+          entry++ )
     {
-      tmp_msgId = *msgId;
-      fprintf(f, "%s%s", tmp_msgId.to_msinfo_format().c_str(), delim.c_str());
+      fprintf(f, "%s%s", entry->c_str(), delim.c_str());
     }
 }
 
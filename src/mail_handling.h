@@ -1,8 +1,28 @@
 #ifndef __MAILSYNC_MAILHANDLING__
 #include "c-client-header.h"
+#include "spill.h"
 
 //------------------------- Helper functions -----------------------------
 
+//////////////////////////////////////////////////////////////////////////
+//
+void msinfo_entries( const MsgIdSet& msgIds, vector<string>& entries);
+//
+// Return the message ids in "msgIds" in msinfo format sorted
+// alphabetically
+// 
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+void msinfo_entries( const SpilledIds& msgIds, vector<string>& entries);
+void print_msinfo_entries( const SpilledIds& msgIds, FILE* f);
+//
+// Same for spilled message ids, which are already sorted by message id -
+// msinfo entries of spilled mailboxes follow that order
+//
+//////////////////////////////////////////////////////////////////////////
+
 //////////////////////////////////////////////////////////////////////////
 //
 void print_list_with_delimiter( const MsgIdSet& msgIds,
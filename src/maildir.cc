@@ -0,0 +1,338 @@
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#ifdef HAVE_LINUX_FS_H
+ #include <linux/fs.h>                  // FICLONE
+#endif
+#include <string>
+#include <vector>
+#include "maildir.h"
+#include "utils.h"
+
+//////////////////////////////////////////////////////////////////////////
+//
+string maildir_info( const string& file)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  string::size_type slash = file.rfind( '/' );
+  string::size_type colon = file.rfind( ':' );
+  if ( colon == string::npos || ( slash != string::npos && colon < slash ) )
+    return "";
+  return file.substr( colon );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+MaildirWriter::MaildirWriter( const string& maildir)
+//
+//////////////////////////////////////////////////////////////////////////
+  : path( maildir ), pending(), deliveries( 0 ), pending_bytes( 0 )
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+MaildirWriter::~MaildirWriter()
+//
+// Messages that weren't committed are removed from tmp/ again
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for ( unsigned long i = 0; i < pending.size(); i++ )
+    unlink( (path + "/tmp/" + pending[i].tmp).c_str() );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+string MaildirWriter::unique_name()
+//
+// A new unique file name as described in the maildir specification
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  struct timeval now;
+  char host[256];
+  char name[512];
+  gettimeofday( &now, NULL );
+  if ( gethostname( host, sizeof(host) ) != 0 )
+    strcpy( host, "localhost" );
+  host[sizeof(host)-1] = 0;
+  // '/' and ':' aren't allowed in the host part
+  for ( char* c = host; *c; c++ )
+    if ( *c == '/' || *c == ':' )
+      *c = '_';
+  sprintf( name, "%ld.M%ldP%ldQ%lu.%s", (long) now.tv_sec,
+           (long) now.tv_usec, (long) getpid(), ++deliveries, host );
+  return name;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MaildirWriter::copy_file( const string& from, const string& to)
+//
+// Copy the file "from" to the new file "to" - as a reflink if the file
+// system supports it, else within the kernel if possible
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  int in = open( from.c_str(), O_RDONLY );
+  if ( in < 0 )
+    return false;
+  int out = open( to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600 );
+  if ( out < 0 ) {
+    close( in );
+    return false;
+  }
+
+  bool copied = false;
+#ifdef FICLONE
+  copied = ioctl( out, FICLONE, in ) == 0;
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+  if (! copied ) {
+    ssize_t n;
+    while ( (n = copy_file_range( in, NULL, out, NULL, 1 << 30, 0 )) > 0 )
+      ;
+    copied = n == 0;
+    // cross file system copies aren't supported by older kernels
+    if (! copied && lseek( out, 0, SEEK_CUR ) == 0 )
+      lseek( in, 0, SEEK_SET );
+    else if (! copied ) {
+      close( in );
+      close( out );
+      unlink( to.c_str() );
+      return false;
+    }
+  }
+#endif // HAVE_COPY_FILE_RANGE
+  if (! copied ) {
+    char buf[65536];
+    ssize_t n;
+    copied = true;
+    while ( copied && (n = read( in, buf, sizeof(buf) )) != 0 ) {
+      if ( n < 0 || write( out, buf, n ) != n )
+        copied = false;
+    }
+  }
+  close( in );
+  if ( close( out ) != 0 )
+    copied = false;
+  if (! copied )
+    unlink( to.c_str() );
+  return copied;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MaildirWriter::add_file( const string& file)
+//
+// Deliver the message in the maildir file "file", keeping its flags.
+// It's hard linked if it's on the same file system, else copied.
+//
+// Returns false if the message couldn't be put into tmp/
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Delivery delivery;
+  delivery.tmp = unique_name();
+  string info = maildir_info( file );
+  delivery.target = ( info.empty() ? "new/" : "cur/" ) + delivery.tmp + info;
+  delivery.has_text = false;
+  string tmp = path + "/tmp/" + delivery.tmp;
+
+  if ( link( file.c_str(), tmp.c_str() ) == 0 )
+    delivery.needs_sync = false;
+  else if ( copy_file( file, tmp ) )
+    delivery.needs_sync = true;
+  else {
+    fprintf( stderr, "Error: Couldn't copy %s to %s: %s\n",
+                     file.c_str(), tmp.c_str(), strerror(errno) );
+    return false;
+  }
+  pending.push_back( delivery );
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void MaildirWriter::add_message( const string& text, const string& info,
+                                 time_t date)
+//
+// Deliver the message "text" with the maildir info "info", e.g. ":2,S",
+// and the internal date "date" - it's kept as the modification time. The
+// text is written by commit().
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Delivery delivery;
+  delivery.tmp = unique_name();
+  delivery.target = ( info.empty() ? "new/" : "cur/" ) + delivery.tmp + info;
+  delivery.text = text;
+  delivery.date = date;
+  delivery.has_text = true;
+  delivery.needs_sync = true;
+  pending.push_back( delivery );
+  pending_bytes += text.length();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MaildirWriter::batch_full() const
+//
+// Say whether it's time to commit()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  return pending.size() >= MAILDIR_BATCH_MESSAGES
+         || pending_bytes >= MAILDIR_BATCH_BYTES;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool sync_file( const string& file)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  int fd = open( file.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return false;
+  bool synced = fsync( fd ) == 0;
+  close( fd );
+  return synced;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool write_file( const string& file, const string& text, time_t date)
+//
+// Write "text" to the new file "file" and fsync it
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  int fd = open( file.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600 );
+  if ( fd < 0 )
+    return false;
+  const char* data = text.data();
+  size_t left = text.length();
+  bool written = true;
+  while ( written && left ) {
+    ssize_t n = write( fd, data, left );
+    if ( n < 0 && errno == EINTR )
+      continue;
+    written = n > 0;
+    if ( written ) {
+      data += n;
+      left -= n;
+    }
+  }
+  written = written && fsync( fd ) == 0;
+  if ( close( fd ) != 0 )
+    written = false;
+  if ( written && date ) {
+    struct utimbuf times;
+    times.actime = times.modtime = date;
+    utime( file.c_str(), &times );
+  }
+  if (! written )
+    unlink( file.c_str() );
+  return written;
+}
+
+// Share of the deliveries of a batch one thread writes and syncs
+struct MaildirWriter::WriteJob
+{
+  const string* path;
+  const vector<MaildirWriter::Delivery>* deliveries;
+  vector<char>* done;
+  unsigned long first, step;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+void* MaildirWriter::write_deliveries( void* data)
+//
+// Write or sync every "step"th delivery, starting with "first"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  WriteJob* job = (WriteJob*) data;
+  for ( unsigned long i = job->first; i < job->deliveries->size();
+        i += job->step ) {
+    const Delivery& delivery = (*job->deliveries)[i];
+    string tmp = *job->path + "/tmp/" + delivery.tmp;
+    if ( delivery.has_text )
+      (*job->done)[i] = write_file( tmp, delivery.text, delivery.date );
+    else
+      (*job->done)[i] = ! delivery.needs_sync || sync_file( tmp );
+  }
+  return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MaildirWriter::commit()
+//
+// Make the messages added so far visible: write and fsync the new files,
+// move all of them to new/ or cur/ and fsync these directories once
+//
+// Returns false if a message couldn't be delivered. Others may have been.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  bool success = true;
+  bool to_new = false, to_cur = false;
+
+  unsigned threads = MAILDIR_WRITE_THREADS;
+  if ( pending.size() < 2 * threads )
+    threads = 1;
+  vector<char> done( pending.size(), 0 );
+  vector<WriteJob> jobs( threads );
+  vector<void*> job_ptrs( threads );
+  for ( unsigned t = 0; t < threads; t++ ) {
+    jobs[t].path = &path;
+    jobs[t].deliveries = &pending;
+    jobs[t].done = &done;
+    jobs[t].first = t;
+    jobs[t].step = threads;
+    job_ptrs[t] = &jobs[t];
+  }
+  run_in_threads( write_deliveries, job_ptrs );
+
+  for ( unsigned long i = 0; i < pending.size(); i++ ) {
+    string tmp = path + "/tmp/" + pending[i].tmp;
+    if (! done[i] ) {
+      fprintf( stderr, "Error: Couldn't write %s\n", tmp.c_str() );
+      unlink( tmp.c_str() );
+      success = false;
+    }
+    else if ( rename( tmp.c_str(),
+                      (path + "/" + pending[i].target).c_str() ) != 0 ) {
+      fprintf( stderr, "Error: Couldn't move %s to %s: %s\n",
+                       tmp.c_str(), pending[i].target.c_str(),
+                       strerror(errno) );
+      unlink( tmp.c_str() );
+      success = false;
+    }
+    else if ( pending[i].target[0] == 'n' )
+      to_new = true;
+    else
+      to_cur = true;
+  }
+  pending.clear();
+  pending_bytes = 0;
+
+  if ( to_new && ! sync_file( path + "/new" ) )
+    success = false;
+  if ( to_cur && ! sync_file( path + "/cur" ) )
+    success = false;
+  return success;
+}
@@ -0,0 +1,72 @@
+#ifndef __MAILSYNC_MAILDIR__
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Limits of a batch of messages committed at once
+#define MAILDIR_BATCH_MESSAGES 500
+#define MAILDIR_BATCH_BYTES    (32*1024*1024)
+
+// Number of threads writing and syncing the messages of a batch
+#define MAILDIR_WRITE_THREADS 8
+
+//////////////////////////////////////////////////////////////////////////
+//
+class MaildirWriter
+//
+// Delivers messages into a local maildir without c-client
+//
+// Messages are added as files with add_file(), which puts them into tmp/
+// right away, or as text with add_message(). commit() writes the texts
+// to tmp/ and fsyncs all new files, by several threads if pthreads are
+// available, then moves the messages to new/ or cur/ and fsyncs these
+// directories once. Until then the messages aren't visible in the
+// maildir, and a crash leaves them in tmp/ at worst, as maildir intends.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    MaildirWriter( const string& path);
+    ~MaildirWriter();
+
+    bool add_file( const string& file);
+    void add_message( const string& text, const string& info, time_t date);
+    bool batch_full() const;
+    bool commit();
+
+  private:
+    struct Delivery
+    {
+      string tmp;                       // name in tmp/
+      string target;                    // name in new/ or cur/
+      string text;                      // to be written to tmp/
+      time_t date;                      // internal date of "text"
+      bool has_text;
+      bool needs_sync;                  // data was written, not linked
+    };
+    string path;
+    vector<Delivery> pending;
+    unsigned long deliveries;
+    unsigned long long pending_bytes;
+
+    struct WriteJob;
+
+    string unique_name();
+    static bool copy_file( const string& from, const string& to);
+    static void* write_deliveries( void* job);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+string maildir_info( const string& file);
+//
+// The info part of the maildir file name "file", e.g. ":2,FS", or "" for
+// messages that are still in new/
+//
+//////////////////////////////////////////////////////////////////////////
+
+#define __MAILSYNC_MAILDIR__
+#endif
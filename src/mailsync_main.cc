@@ -6,6 +6,9 @@
 
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <errno.h>
 extern int errno;               // Just in case
 
@@ -30,6 +33,12 @@ using std::make_pair;
 #include "channel.h"           // Channel
 #include "mail_handling.h"     // functions implementing various
                                // synchronization steps and helper functions
+#include "classify.h"          // three way classification of a mailbox
+#include "spill.h"             // out of core message id lists
+#include "msgid_policy.h"      // Md5Identity
+#include "plan.h"              // SyncPlan, execute_plan
+#include "native_scan.h"       // native scanning of local mailboxes
+#include "watch.h"             // MailboxWatcher for --watch
 
 //------------------------------- Defines  -------------------------------
 
@@ -46,12 +55,1429 @@ options_t options;
 // won't link correctly if this is static - why?
 Store*       match_pattern_store;
 
+// where mm_status() puts the status Store::mailbox_status() asked for
+MAILSTATUS*  requested_status = NULL;
+
+// all message ids seen during this run
+MsgIdTable   msgid_table;
+
+//////////////////////////////////////////////////////////////////////////
+// The password for the current context
+// Required, because we don't know inside the c-client callback functions
+// which context (store1, store2, channel) we are in
+Passwd * current_context_passwd = NULL;
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool needs_md5_migration( const MsgIdSet& lasttime)
+//
+// Say whether the HASH_MSGID message ids seen last time still contain md5
+// message ids from an msinfo that was written with "-t md5"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for ( MsgIdSet::const_iterator i = lasttime.begin(); i != lasttime.end(); i++)
+    if ( msgid_table.msgid( *i ).is_md5_msgid() )
+      return true;
+  return false;
+}
+
+#ifdef HAVE_MD5
+//////////////////////////////////////////////////////////////////////////
+//
+unsigned long migrate_md5_msgids( Store& store, const MsgIdPositions& mids,
+                                  MsgIdSet& lasttime)
+//
+// Replace the md5 message ids in "lasttime" by the HASH_MSGID ids of the
+// same messages in "store". The envelopes are cached by c-client since
+// fetch_message_ids(), so this doesn't talk to the server again.
+//
+// Returns the number of migrated message ids
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long migrated = 0;
+  for ( MsgIdPositions::const_iterator i = mids.begin(); i != mids.end(); i++)
+  {
+    ENVELOPE* envelope = mail_fetchenvelope( store.stream, i->second );
+    MsgIdHandle md5;
+    if ( envelope
+         && msgid_table.find( Md5Identity::from_envelope( envelope ), md5 )
+         && lasttime.erase( md5 ) )
+    {
+      lasttime.insert( i->first );
+      migrated++;
+    }
+  }
+  return migrated;
+}
+#endif // HAVE_MD5
+
+// Fraction of the messages that a vanished and a new mailbox must have
+// in common to be taken as renamed
+#define RENAME_THRESHOLD 0.9
+
+// The scan of a mailbox that detect_renames() did. It's used again when
+// the mailbox is synced, unless the mailbox has changed in between.
+struct EarlyScan
+{
+  MsgIdPositions mids;
+  MsgIdSet remove;
+  SetDigest digest;
+  UidCache uids;
+  bool has_uids;
+  ScanState state;
+};
+typedef map<string, EarlyScan> EarlyScans;
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool uses_uid_cache( const Store& store)
+//
+// Say whether the mailbox open in "store" is a remote IMAP mailbox, whose
+// message ids are kept by UID - see UidCache
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  return store.isremote && store.stream
+         && strcmp( store.stream->dtb->name, "imap" ) == 0
+         && store.stream->nmsgs <= UID_CACHE_MAX_MESSAGES;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool scan_mailbox_early( Store& store, const string& mailbox,
+                         EarlyScan& scan)
+//
+// Collect the message ids of "mailbox", to be used again by
+// fetch_ids_by_uid()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  store.stream = store.mailbox_open( mailbox, OP_READONLY );
+  if (! store.stream)
+    return false;
+  scan.state.take( store.stream );
+  scan.has_uids = uses_uid_cache( store );
+  scan.uids.uidvalidity = store.stream->uid_validity;
+  return store.fetch_message_ids( scan.mids, scan.remove, scan.digest,
+                                  scan.has_uids ? &scan.uids : NULL );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void detect_renames( Channel& channel, Store& renamed_on, Store& other,
+                     MsgIdsPerMailbox& lasttime, EarlyScans& scans)
+//
+// Find mailboxes that were renamed in store "renamed_on" since the last
+// sync and rename them in the "other" store as well. Otherwise all of the
+// messages would be copied to a new mailbox in "other" and deleted from
+// the old one.
+//
+// A mailbox was renamed from V to N if
+// + V was seen last time, is still in "other" but no more in "renamed_on"
+// + N is new in "renamed_on"
+// + they have at least RENAME_THRESHOLD of their messages in common
+//
+// Mailboxes with submailboxes are left alone, as renaming them would
+// rename the submailboxes too.
+//
+// The scans of the new mailboxes are kept in "scans".
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  vector<string> vanished, appeared;
+
+  for ( MsgIdsPerMailbox::iterator box = lasttime.begin();
+        box != lasttime.end(); box++ ) {
+    if ( box->second.empty()
+         || renamed_on.boxes.count( box->first )
+         || ! other.boxes.count( box->first ) )
+      continue;
+    // mm_list() gives all mailbox names with the DEFAULT_DELIMITER
+    string inferiors = box->first + DEFAULT_DELIMITER;
+    bool has_inferiors = false;
+    for ( MailboxMap::iterator i = other.boxes.begin();
+          i != other.boxes.end(); i++ )
+      if ( i->first.compare( 0, inferiors.length(), inferiors ) == 0 )
+        has_inferiors = true;
+    if ( ! has_inferiors )
+      vanished.push_back( box->first );
+  }
+  if ( vanished.empty() )
+    return;
+
+  for ( MailboxMap::iterator box = renamed_on.boxes.begin();
+        box != renamed_on.boxes.end(); box++ )
+    if ( ! box->second.no_select
+         && ! other.boxes.count( box->first )
+         && ! lasttime.count( box->first ) )
+      appeared.push_back( box->first );
+
+  for ( unsigned n = 0; n < appeared.size() && ! vanished.empty(); n++ ) {
+    EarlyScan& scan = scans[ appeared[n] ];
+    if ( ! scan_mailbox_early( renamed_on, appeared[n], scan ) ) {
+      scans.erase( appeared[n] );
+      continue;
+    }
+    const MsgIdPositions& ids = scan.mids;
+    if ( ids.empty() )
+      continue;
+
+    // find the vanished mailbox with the most messages in common
+    unsigned best = 0;
+    double best_overlap = 0;
+    for ( unsigned v = 0; v < vanished.size(); v++ ) {
+      const MsgIdSet& old_ids = lasttime[ vanished[v] ];
+      unsigned long common = 0;
+      for ( MsgIdPositions::const_iterator i = ids.begin(); i != ids.end();
+            i++ )
+        common += old_ids.count( i->first );
+      double overlap = (double) common / max( ids.size(), old_ids.size() );
+      if ( overlap > best_overlap ) {
+        best = v;
+        best_overlap = overlap;
+      }
+    }
+    if ( best_overlap < RENAME_THRESHOLD )
+      continue;
+
+    const string& from = vanished[best];
+    const string& to = appeared[n];
+    printf( "%s was renamed to %s in %s\n", from.c_str(), to.c_str(),
+            renamed_on.name.c_str() );
+    if ( ! other.mailbox_rename( from, to ) )
+      continue;
+
+    other.boxes[ to ] = other.boxes[ from ];
+    other.boxes.erase( from );
+    lasttime[ to ].swap( lasttime[ from ] );
+    lasttime.erase( from );
+    channel.tags_lasttime[ to ] = channel.tags_lasttime[ from ];
+    channel.tags_lasttime.erase( from );
+    vanished.erase( vanished.begin() + best );
+  }
+  if ( renamed_on.stream && ! renamed_on.isremote )
+    renamed_on.stream = mail_close( renamed_on.stream );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool fetch_ids_by_uid( Channel& channel, Store& store, const char* tag,
+                       const string& mailbox, const MsgIdSet& lasttime,
+                       bool use_uids, EarlyScans& scans, MsgIdPositions& mids,
+                       MsgIdSet& remove_set, SetDigest& digest)
+//
+// Store::fetch_message_ids() for the open "mailbox" of "store". If that's
+// a remote IMAP mailbox and "use_uids" is set, the message ids of the
+// UIDs known from last time are taken from msinfo, where they're kept
+// under "tag" - see UidCache
+//
+// If detect_renames() scanned the mailbox already and it hasn't changed
+// since, that scan is taken.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  EarlyScans::iterator scan = scans.find( mailbox );
+  if ( scan != scans.end() ) {
+    bool unchanged = scan->second.state.matches( store.stream );
+    if ( unchanged ) {
+      mids.swap( scan->second.mids );
+      remove_set.swap( scan->second.remove );
+      digest = scan->second.digest;
+      if ( use_uids && scan->second.has_uids )
+        channel.tags_thistime[ mailbox ][ tag ] =
+                                            scan->second.uids.to_string();
+    }
+    scans.erase( scan );
+    if ( unchanged )
+      return true;
+  }
+
+  if (! use_uids || ! uses_uid_cache( store ) )
+    return store.fetch_message_ids( mids, remove_set, digest );
+
+  UidCache uids;
+  uids.uidvalidity = store.stream->uid_validity;
+  MsinfoTags& tags = channel.tags_lasttime[ mailbox ];
+  if ( tags.count( tag )
+       && ! uids.from_string( tags[ tag ], store.stream->uid_validity,
+                              lasttime )
+       && options.debug )
+    printf( " UIDVALIDITY of %s in %s has changed\n", mailbox.c_str(),
+            store.name.c_str() );
+  if (! store.fetch_message_ids( mids, remove_set, digest, &uids ) )
+    return false;
+  channel.tags_thistime[ mailbox ][ tag ] = uids.to_string();
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void keep_msinfo_tag( Channel& channel, const string& mailbox,
+                      const char* tag)
+//
+// Write "tag" of "mailbox" to msinfo as it was read, unless it was set
+// this time
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MsinfoTags& lasttime = channel.tags_lasttime[ mailbox ];
+  MsinfoTags& thistime = channel.tags_thistime[ mailbox ];
+  if ( lasttime.count( tag ) && ! thistime.count( tag ) )
+    thistime[ tag ] = lasttime[ tag ];
+}
+
+// Seconds after which --mirror scans a mailbox of store_b again
+#define MIRROR_VERIFY_INTERVAL (7*24*60*60)
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool mirror_verification_due( Channel& channel, const string& mailbox)
+//
+// Say whether the mirrored "mailbox" in store_b is to be scanned this
+// time, because of --verify or because the last scan is too long ago
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( options.verify )
+    return true;
+  MsinfoTags& tags = channel.tags_lasttime[ mailbox ];
+  MsinfoTags::iterator verified = tags.find( "verified" );
+  return verified == tags.end()
+         || time( NULL ) - strtol( verified->second.c_str(), NULL, 10 )
+            >= MIRROR_VERIFY_INTERVAL;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void record_verification( Channel& channel, const string& mailbox,
+                          bool scanned)
+//
+// Remember in msinfo when the mirrored "mailbox" in store_b was last
+// scanned
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MsinfoTags& lasttime = channel.tags_lasttime[ mailbox ];
+  MsinfoTags& thistime = channel.tags_thistime[ mailbox ];
+  if ( scanned ) {
+    char now[30];
+    sprintf( now, "%ld", (long) time( NULL ) );
+    thistime[ "verified" ] = now;
+  }
+  else if ( lasttime.count( "verified" ) )
+    thistime[ "verified" ] = lasttime[ "verified" ];
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool lost_messages( const MsgIdSet& lasttime, const MsgIdPositions& now)
+//
+// Say whether any of the messages seen last time is gone
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for ( MsgIdSet::const_iterator i = lasttime.begin(); i != lasttime.end(); i++)
+    if (! now.count( *i ))
+      return true;
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool lost_messages( const SpilledIds& lasttime, const SpilledIds& now)
+//
+// Same for spilled message ids, with a merge over both lists
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  SpilledIds::Cursor l( lasttime ), n( now );
+  for ( ; ! l.done(); l.next() ) {
+    while (! n.done() && n.key() < l.key())
+      n.next();
+    if ( n.done() || n.key() != l.key() )
+      return true;
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool natively_unchanged( Channel& channel, Store& store, const char* tag,
+                         const string& mailbox,
+                         const SetDigest& digest_lasttime)
+//
+// Say whether "mailbox" of "store" is a local maildir or mbox that holds
+// the same messages as last time, going by a native scan, see
+// native_scan.h
+//
+// Its fingerprint is kept in msinfo under "tag", together with the digest
+// of the messages it held then. If neither has changed the mailbox isn't
+// even scanned.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( store.isremote || options.msgid_type != HEADER_MSGID )
+    return false;
+  string path;
+  SetDigest digest;
+  if (! local_mailbox_path( store.full_mailbox_name( mailbox ), path ) )
+    return false;
+
+  // the fingerprint is taken before the scan, so that it can't cover
+  // changes the scan missed
+  time_t now = time( NULL );
+  string fingerprint;
+  time_t modified;
+  bool fingerprinted = mailbox_fingerprint( path, fingerprint, modified );
+  MsinfoTags& lasttime = channel.tags_lasttime[ mailbox ];
+  MsinfoTags& thistime = channel.tags_thistime[ mailbox ];
+  if ( fingerprinted && lasttime.count( tag )
+       && lasttime[ tag ] == digest_lasttime.to_string() + " " + fingerprint ) {
+    if ( options.debug )
+      printf( " Fingerprint of %s unchanged\n", path.c_str() );
+    thistime[ tag ] = lasttime[ tag ];
+    return true;
+  }
+
+  // the tag holds the three numbers of a digest, then the fingerprint
+  string before;
+  if ( lasttime.count( tag ) ) {
+    string::size_type start = 0;
+    for ( int n = 0; n < 3 && start != string::npos; n++ )
+      start = lasttime[ tag ].find( ' ', start + 1 );
+    if ( start != string::npos )
+      before = lasttime[ tag ].substr( start + 1 );
+  }
+  if ( fingerprinted
+       && surely_changed( path, fingerprint, before, digest_lasttime.size() ) ) {
+    if ( options.debug )
+      printf( " Fingerprint of %s shows changes\n", path.c_str() );
+    return false;
+  }
+
+  if ( is_maildir( path ) ) {
+    if (! maildir_digest( path, digest ) )
+      return false;
+  }
+  else if (! is_mbox( path ) || ! mbox_digest( path, digest ) )
+    return false;
+  if ( options.debug )
+    printf( " Scanned %s natively: %s\n", path.c_str(),
+            digest == digest_lasttime ? "unchanged" : "changed" );
+  if ( fingerprinted && modified < now )
+    thistime[ tag ] = digest.to_string() + " " + fingerprint;
+  return digest == digest_lasttime;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool remotely_unchanged( Channel& channel, Store& store, const char* tag,
+                         const string& mailbox,
+                         const SetDigest& digest_lasttime, string& status)
+//
+// Say whether "mailbox" of the remote "store" holds the same messages as
+// last time, going by its STATUS: as long as its number of messages,
+// UIDNEXT and UIDVALIDITY stay the same no message was added or
+// expunged.
+//
+// The STATUS is kept in msinfo under "tag", together with the digest of
+// the messages the mailbox held then. If it has changed it's left in
+// "status", to be recorded with the digest of the scan that follows.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MAILSTATUS now;
+  status = "";
+  if (! store.isremote || ! store.mailbox_status( mailbox, now ) )
+    return false;
+
+  char buf[100];
+  sprintf( buf, "status %lu %lu %lu", now.messages, now.uidnext,
+           now.uidvalidity );
+  MsinfoTags& lasttime = channel.tags_lasttime[ mailbox ];
+  if ( lasttime.count( tag )
+       && lasttime[ tag ] == digest_lasttime.to_string() + " " + buf ) {
+    if ( options.debug )
+      printf( " STATUS of %s in %s unchanged\n", mailbox.c_str(),
+              store.name.c_str() );
+    channel.tags_thistime[ mailbox ][ tag ] = lasttime[ tag ];
+    return true;
+  }
+  status = buf;
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void print_one_sided( Store& store, unsigned long msgno, const char* side,
+                      const string& msgid)
+//
+// Report a message --adopt found in only one of the stores
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (! options.show_from && ! options.show_message_id )
+    return;
+  print_lead( "only", side );
+  if ( options.show_from )
+    print_from( store.stream, msgno );
+  if ( options.show_message_id )
+    print_msgid( msgid.c_str() );
+  printf( "\n" );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void adopt_messages( Store& store_a, Store& store_b,
+                     const MsgIdPositions& a, const MsgIdPositions& b,
+                     MsgIdSet& now)
+//
+// For --adopt: take the messages that are in both stores as the ones seen
+// last time and report the others
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long only_a = 0, only_b = 0;
+  MsgIdPositions::const_iterator i;
+  for ( i = a.begin(); i != a.end(); i++ )
+    if ( b.count( i->first ) )
+      now.insert( i->first );
+    else {
+      only_a++;
+      print_one_sided( store_a, i->second, "< ",
+                       msgid_table.msgid( i->first ).printable() );
+    }
+  for ( i = b.begin(); i != b.end(); i++ )
+    if (! a.count( i->first ) ) {
+      only_b++;
+      print_one_sided( store_b, i->second, " >",
+                       msgid_table.msgid( i->first ).printable() );
+    }
+  printf( "%lu on both, %lu only on %s, %lu only on %s.\n",
+          (unsigned long) now.size(), only_a, store_a.name.c_str(),
+          only_b, store_b.name.c_str() );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void adopt_messages( Store& store_a, Store& store_b,
+                     const SpilledIds& a, const SpilledIds& b,
+                     SpilledIds& now)
+//
+// Same for spilled message ids, with a merge over both lists
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long only_a = 0, only_b = 0;
+  SpilledIds::Cursor i( a ), j( b );
+  while (! i.done() || ! j.done() ) {
+    if (! i.done() && ( j.done() || i.key() < j.key() )) {
+      only_a++;
+      print_one_sided( store_a, i.msgno(), "< ",
+                       MsgId( i.key() ).printable() );
+      i.next();
+    }
+    else if ( i.done() || j.key() < i.key() ) {
+      only_b++;
+      print_one_sided( store_b, j.msgno(), " >",
+                       MsgId( j.key() ).printable() );
+      j.next();
+    }
+    else {
+      now.append( i.key(), 0 );
+      i.next();
+      j.next();
+    }
+  }
+  printf( "%lu on both, %lu only on %s, %lu only on %s.\n",
+          now.size(), only_a, store_a.name.c_str(),
+          only_b, store_b.name.c_str() );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+int sync_channel( Channel& channel, const set<string>* only)
+//
+// Sync - or diff - the mailboxes of "channel", or if "only" is given just
+// the ones in it. What msinfo says about the others is kept as it is.
+// The mailboxes of both stores must have been listed, remote stores are
+// left open.
+//
+// Returns what main() is to return
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Store& store_a = channel.store_a;
+  Store& store_b = channel.store_b;
+  MsgIdsPerMailbox lasttime, thistime;
+  SpilledIdsPerMailbox spilled_lasttime, spilled_thistime;  // --max-memory
+  MailboxMap deleted_mailboxes;   // present lasttime, but not this time
+  MailboxMap empty_mailboxes;
+  EarlyScans early_a, early_b;    // new mailboxes detect_renames() scanned
+  int success;
+  bool& debug = options.debug;
+
+  channel.tags_lasttime.clear();
+  channel.tags_thistime.clear();
+
+  // A plan saved with --plan-in is carried out as it is, without reading
+  // msinfo and scanning. msinfo is left alone: messages that get copied
+  // will be found on both sides next time, removed ones on neither.
+  SyncPlan plan;
+  if ( options.plan_in && ! read_plan( channel, plan, options.plan_in ) )
+    exit(1);
+
+  // Read in what mailboxes and messages we've seen the last time
+  // we've synchronized
+  if (! options.plan_in && ! options.adopt
+      && ! channel.read_lasttime_seen( lasttime, spilled_lasttime,
+                                       deleted_mailboxes) )
+    exit(1);    // failed to read in msinfo or similar
+
+
+  // Follow mailboxes that were renamed on either side. That's done right
+  // away, so not when only planning.
+  if ( operation_mode == mode_sync && ! options.plan_in
+       && ! options.plan_out && ! options.adopt && ! only ) {
+    detect_renames( channel, store_a, store_b, lasttime, early_a );
+    detect_renames( channel, store_b, store_a, lasttime, early_b );
+  }
+
+  // Plan the sync: iterate over the mailboxes of both stores, scan and
+  // classify each. In diff mode that's all there is to do. In sync mode
+  // nothing is changed until all mailboxes have been scanned, so that
+  // messages that were moved between mailboxes can be recognized.
+  //
+  // our comparison operator for our stores compares lenghts
+  // that means that we're traversing the store from longest to
+  // shortest mailbox name - this makes sure that we'll first see
+  // and create mailboxes with longer "path"names that means 
+  // submailboxes first
+  MailboxMap all_boxes;
+  if (! options.plan_in) {
+    all_boxes = store_a.boxes;
+    all_boxes.insert( store_b.boxes.begin(), store_b.boxes.end() );
+  }
+  success = 1; // TODO: this is bogus isn't it?
+  for ( MailboxMap::iterator curr_mbox = all_boxes.begin(); 
+        curr_mbox != all_boxes.end();
+        curr_mbox++ )
+  {
+    // the mailboxes left out keep what msinfo says about them
+    if ( only && ! only->count( curr_mbox->first ) ) {
+      SpilledIdsPerMailbox::iterator s = spilled_lasttime.find(
+                                                         curr_mbox->first );
+      MsgIdsPerMailbox::iterator l = lasttime.find( curr_mbox->first );
+      if ( s != spilled_lasttime.end() ) {
+        spilled_thistime[curr_mbox->first] = s->second;
+        spilled_lasttime.erase( s );
+      }
+      else if ( l != lasttime.end() )
+        thistime[curr_mbox->first].swap( l->second );
+      if ( channel.tags_lasttime.count( curr_mbox->first ) )
+        channel.tags_thistime[curr_mbox->first] =
+                                     channel.tags_lasttime[curr_mbox->first];
+      continue;
+    }
+
+    MailboxMap::iterator box_a = store_a.boxes.find( curr_mbox->first );
+    MailboxMap::iterator box_b = store_b.boxes.find( curr_mbox->first );
+    bool exists_a = box_a != store_a.boxes.end();
+    // in diff mode msinfo stands in for store_b
+    bool exists_b = box_b != store_b.boxes.end()
+                    || operation_mode == mode_diff;
+
+    // a mirror leaves mailboxes that are only in store_b alone
+    if ( ! exists_a && options.mirror && operation_mode == mode_sync )
+      continue;
+
+    // if mailbox doesn't exist in either one of the stores -> create it.
+    // Until then it's just empty.
+    if ( ! exists_a && ! options.adopt )
+      plan.create_a.push_back( curr_mbox->first );
+    if ( ! exists_b && ! options.adopt )
+      plan.create_b.push_back( curr_mbox->first );
+
+    // skip unselectable (== can't contain mails) boxes
+    if ( ( exists_a && box_a->second.no_select )
+         || ( box_b != store_b.boxes.end() && box_b->second.no_select ) ) {
+      if ( debug )
+        printf( "%s is not selectable: skipping\n", curr_mbox->first.c_str() );
+      continue;
+    }
+
+    print_mailbox_header( curr_mbox->first );
+
+    MsgIdSet& msgids_lasttime = lasttime[curr_mbox->first];
+    MsgIdSet msgids_now;
+    MsgIdPositions msgidpos_a, msgidpos_b;
+
+    // fetch_message_ids(): map message-ids to message numbers
+    //                      and optionally remember duplicates. 
+    //
+    // Attention: from here on we're operating on streams to single
+    //            _mailboxes_! That means that from here on
+    //            streamx_stream is connected to _one_ specific
+    //            mailbox.
+   
+    // Messges that should be removed in store_a respectively in store_b
+    MsgIdSet remove_a, remove_b;
+
+    SetDigest digest_lasttime;
+    bool have_digest = channel.lasttime_digest( curr_mbox->first,
+                                                digest_lasttime );
+
+    // A local maildir or mbox that still holds the messages of last time
+    // isn't opened with c-client, nor is a remote mailbox whose STATUS
+    // says so. Its message numbers are only needed if messages are to be
+    // removed from it - then it's scanned after all.
+    bool md5_lasttime = options.msgid_type == HASH_MSGID
+                        && needs_md5_migration( msgids_lasttime );
+    string status_a, status_b;          // to be recorded after the scan
+    bool native_a = exists_a && have_digest
+                    && ( natively_unchanged( channel, store_a, "fingerprint_a",
+                                             curr_mbox->first,
+                                             digest_lasttime )
+                         || ( ! md5_lasttime
+                              && remotely_unchanged( channel, store_a,
+                                                     "status_a",
+                                                     curr_mbox->first,
+                                                     digest_lasttime,
+                                                     status_a ) ) );
+
+    // open the mailbox in the first store
+    if ( exists_a && ! native_a ) {
+      store_a.stream = store_a.mailbox_open( curr_mbox->first, OP_READONLY );
+      if (! store_a.stream)
+      {
+        store_a.print_error( "opening and writing", curr_mbox->first);
+        continue;
+      }
+    }
+
+    // In --mirror mode msinfo stands in for the mailbox in store_b. It's
+    // only scanned to verify it now and then, or if messages have to be
+    // removed from it.
+    bool mirror_b = operation_mode == mode_sync && options.mirror && exists_b
+                    && have_digest
+                    && ! mirror_verification_due( channel, curr_mbox->first )
+                    && ! md5_lasttime;
+
+    bool native_b = operation_mode == mode_sync && exists_b && ! mirror_b
+                    && have_digest
+                    && ( natively_unchanged( channel, store_b, "fingerprint_b",
+                                             curr_mbox->first,
+                                             digest_lasttime )
+                         || ( ! md5_lasttime
+                              && remotely_unchanged( channel, store_b,
+                                                     "status_b",
+                                                     curr_mbox->first,
+                                                     digest_lasttime,
+                                                     status_b ) ) );
+
+    // if we're in sync mode open the mailbox in the second store
+    if( operation_mode == mode_sync && exists_b && ! mirror_b && ! native_b ) {
+      store_b.stream = store_b.mailbox_open( curr_mbox->first, OP_READONLY);
+      if (! store_b.stream) {
+        store_b.print_error( "fetching of mail ids", curr_mbox->first);
+        continue;
+      }
+    }
+
+    // If all the message ids of this mailbox would exceed the memory
+    // budget we spill them to disk and classify them there
+    SpilledIdsPerMailbox::iterator spilled = 
+                                 spilled_lasttime.find( curr_mbox->first );
+    bool out_of_core = false;
+    // migrating md5 ids to HASH_MSGID needs all ids in memory
+    bool migrate_md5 = options.msgid_type == HASH_MSGID
+                       && spilled == spilled_lasttime.end()
+                       && needs_md5_migration( msgids_lasttime );
+    if ( options.max_memory && ! migrate_md5 ) {
+      unsigned long n_ids = ( exists_a && ! native_a
+                                        ? store_a.stream->nmsgs : 0 )
+        + ( spilled != spilled_lasttime.end() ? spilled->second->size()
+                                              : msgids_lasttime.size() )
+        + ( operation_mode == mode_sync && exists_b && ! mirror_b
+                                        && ! native_b
+                                        ? store_b.stream->nmsgs : 0 );
+      out_of_core = spilled != spilled_lasttime.end()
+                    || n_ids > options.max_memory / BYTES_PER_MSGID;
+    }
+    size_t chunk_size = options.max_memory / 4;
+    SpilledIds spilled_a( chunk_size ), spilled_b( chunk_size );
+    SpilledIds* spilled_remove_a = new SpilledIds( chunk_size );
+    SpilledIds* spilled_remove_b = new SpilledIds( chunk_size );
+    SpilledIds* spilled_now = NULL;
+    SetDigest digest_a, digest_b;
+
+    // from here on the spilled duplicates belong to "sync"
+    MailboxPlan* sync = new MailboxPlan( curr_mbox->first );
+    sync->out_of_core = out_of_core;
+    sync->duplicates_a = spilled_remove_a;
+    sync->duplicates_b = spilled_remove_b;
+
+    if ( out_of_core ) {
+      if (debug)
+        printf( " Classifying mailbox \"%s\" out of core\n",
+                curr_mbox->first.c_str() );
+      if ( spilled == spilled_lasttime.end() ) {
+        SpilledIds* ids = new SpilledIds( chunk_size );
+        for( MsgIdSet::const_iterator i=msgids_lasttime.begin();
+             i!=msgids_lasttime.end();
+             i++ )
+          ids->add( msgid_table.msgid(*i), 0 );
+        spilled = spilled_lasttime.insert(
+                      make_pair( curr_mbox->first, ids ) ).first;
+        if (! ids->finish( NULL ))
+          exit(1);
+      }
+      if ( native_a )
+        ;                               // see below, once store_b is known
+      else if ( exists_a && ! store_a.fetch_message_ids( spilled_a,
+                                                         *spilled_remove_a,
+                                                         digest_a ) )
+      {
+        store_a.print_error( "fetching of mail ids", curr_mbox->first);
+        delete sync;
+        continue;
+      }
+      if ( ( mirror_b || native_b ) && ! native_a
+           && lost_messages( *spilled->second, spilled_a ) ) {
+        mirror_b = native_b = false;
+        store_b.stream = store_b.mailbox_open( curr_mbox->first, OP_READONLY);
+        if (! store_b.stream) {
+          store_b.print_error( "fetching of mail ids", curr_mbox->first);
+          delete sync;
+          continue;
+        }
+      }
+      if ( mirror_b || native_b ) {
+        for( SpilledIds::Cursor i( *spilled->second ); ! i.done(); i.next() )
+          spilled_b.append( i.key(), 0 );
+        digest_b = digest_lasttime;
+      } else if( operation_mode == mode_sync ) {
+        if ( exists_b && ! store_b.fetch_message_ids( spilled_b,
+                                                      *spilled_remove_b,
+                                                      digest_b )) {
+          store_b.print_error( "fetching of mail ids", curr_mbox->first);
+          delete sync;
+          continue;
+        }
+      } else if( operation_mode == mode_diff ) {
+        for( SpilledIds::Cursor i( *spilled->second ); ! i.done(); i.next() )
+          spilled_b.append( i.key(), 0 );
+      }
+      if ( native_a && lost_messages( *spilled->second, spilled_b ) ) {
+        native_a = false;
+        store_a.stream = store_a.mailbox_open( curr_mbox->first, OP_READONLY);
+        if (! store_a.stream
+            || ! store_a.fetch_message_ids( spilled_a, *spilled_remove_a,
+                                            digest_a ) ) {
+          store_a.print_error( "fetching of mail ids", curr_mbox->first);
+          delete sync;
+          continue;
+        }
+      }
+      if ( native_a ) {
+        for( SpilledIds::Cursor i( *spilled->second ); ! i.done(); i.next() )
+          spilled_a.append( i.key(), 0 );
+        digest_a = digest_lasttime;
+      }
+    }
+    else {
+      if ( native_a )
+        ;                               // see below, once store_b is known
+      else if ( exists_a
+                && ! fetch_ids_by_uid( channel, store_a, "uids_a",
+                                       curr_mbox->first, msgids_lasttime,
+                                       ! migrate_md5, early_a, msgidpos_a,
+                                       remove_a, digest_a ) )
+      {
+        store_a.print_error( "fetching of mail ids", curr_mbox->first);
+        delete sync;
+        continue;
+      }
+      if ( ( mirror_b || native_b ) && ! native_a
+           && lost_messages( msgids_lasttime, msgidpos_a ) ) {
+        mirror_b = native_b = false;
+        store_b.stream = store_b.mailbox_open( curr_mbox->first, OP_READONLY);
+        if (! store_b.stream) {
+          store_b.print_error( "fetching of mail ids", curr_mbox->first);
+          delete sync;
+          continue;
+        }
+      }
+      if ( mirror_b || native_b ) {
+        for( MsgIdSet::iterator i=msgids_lasttime.begin();
+             i!=msgids_lasttime.end();
+             i++ )
+          msgidpos_b[*i] = 0;
+        digest_b = digest_lasttime;
+      } else if( operation_mode == mode_sync ) {
+        if ( exists_b
+             && ! fetch_ids_by_uid( channel, store_b, "uids_b",
+                                    curr_mbox->first, msgids_lasttime,
+                                    ! migrate_md5, early_b, msgidpos_b,
+                                    remove_b, digest_b ) ) {
+          store_b.print_error( "fetching of mail ids", curr_mbox->first);
+          delete sync;
+          continue;
+        }
+      }
+      if ( native_a && operation_mode == mode_sync
+           && lost_messages( msgids_lasttime, msgidpos_b ) ) {
+        native_a = false;
+        store_a.stream = store_a.mailbox_open( curr_mbox->first, OP_READONLY);
+        if (! store_a.stream
+            || ! fetch_ids_by_uid( channel, store_a, "uids_a",
+                                   curr_mbox->first, msgids_lasttime,
+                                   ! migrate_md5, early_a, msgidpos_a,
+                                   remove_a, digest_a ) ) {
+          store_a.print_error( "fetching of mail ids", curr_mbox->first);
+          delete sync;
+          continue;
+        }
+      }
+      if ( native_a ) {
+        for( MsgIdSet::iterator i=msgids_lasttime.begin();
+             i!=msgids_lasttime.end();
+             i++ )
+          msgidpos_a[*i] = 0;
+        digest_a = digest_lasttime;
+      }
+      if ( migrate_md5 ) {
+#ifdef HAVE_MD5
+        unsigned long migrated = migrate_md5_msgids( store_a, msgidpos_a,
+                                                     msgids_lasttime );
+        if( operation_mode == mode_sync )
+          migrated += migrate_md5_msgids( store_b, msgidpos_b,
+                                          msgids_lasttime );
+        if (debug)
+          printf( " Migrated %lu md5 message ids\n", migrated );
+#else
+        fprintf( stderr, "Warning: msinfo contains md5 message ids, but"
+                         " mailsync was compiled without md5 support.\n"
+                         "         Deletions since the last sync of %s"
+                         " can't be recognized.\n",
+                         curr_mbox->first.c_str() );
+#endif // HAVE_MD5
+      }
+      if( operation_mode == mode_diff ) {
+        for( MsgIdSet::iterator i=msgids_lasttime.begin();
+             i!=msgids_lasttime.end();
+             i++ )
+        {
+             msgidpos_b[*i] = 0;
+        }
+      }
+    }
+
+    // the STATUS taken before a scan goes with what the scan found
+    if ( exists_a && ! native_a && ! status_a.empty() )
+      channel.tags_thistime[ curr_mbox->first ][ "status_a" ] =
+                                       digest_a.to_string() + " " + status_a;
+    if ( exists_b && ! native_b && ! mirror_b && ! status_b.empty() )
+      channel.tags_thistime[ curr_mbox->first ][ "status_b" ] =
+                                       digest_b.to_string() + " " + status_b;
+
+    // bulk copies go by the message numbers of the scan
+    if ( exists_a && ! native_a )
+      sync->scanned_a.take( store_a.stream );
+    if ( operation_mode == mode_sync && exists_b && ! mirror_b && ! native_b )
+      sync->scanned_b.take( store_b.stream );
+
+    // The first sync onto an empty mailbox is done in bulk
+    if ( out_of_core )
+      sync->initial = spilled->second->size() == 0
+                      && ( spilled_a.size() + spilled_remove_a->size() == 0
+                           || spilled_b.size() + spilled_remove_b->size() == 0 );
+    else
+      sync->initial = msgids_lasttime.empty()
+                      && ( msgidpos_a.size() + remove_a.size() == 0
+                           || msgidpos_b.size() + remove_b.size() == 0 );
+
+    // Classify all seen message IDs in a mailbox:
+    // + message IDs seen the last time
+    // + message IDs seen in the mailbox from store_a
+    // + message IDs seen in the mailbox from store_b
+    Classification result;
+    SpilledClassification* spilled_result = NULL;
+    unsigned long now_n, new_n, deleted_b_n;
+
+    if ( operation_mode == mode_sync && options.mirror )
+      record_verification( channel, curr_mbox->first, ! mirror_b );
+
+    // what UIDs stand for doesn't change, also if they weren't looked at
+    keep_msinfo_tag( channel, curr_mbox->first, "uids_a" );
+    keep_msinfo_tag( channel, curr_mbox->first, "uids_b" );
+
+    // --adopt takes what's in both stores as synced and leaves the rest
+    if ( options.adopt ) {
+      if ( out_of_core ) {
+        spilled_now = new SpilledIds( chunk_size );
+        adopt_messages( store_a, store_b, spilled_a, spilled_b, *spilled_now );
+        spilled_thistime[curr_mbox->first] = spilled_now;
+      }
+      else {
+        adopt_messages( store_a, store_b, msgidpos_a, msgidpos_b, msgids_now );
+        thistime[curr_mbox->first].swap( msgids_now );
+      }
+      delete sync;
+      if (store_a.stream && !store_a.isremote)
+        store_a.stream = mail_close(store_a.stream);
+      if (store_b.stream && !store_b.isremote)
+        store_b.stream = mail_close(store_b.stream);
+      continue;
+    }
+
+    // If neither side has changed since the last sync there's nothing to
+    // classify - the digests tell without comparing the message ids
+    bool unchanged = ! migrate_md5
+                     && have_digest
+                     && digest_a == digest_lasttime
+                     && ( operation_mode == mode_diff
+                          || digest_b == digest_lasttime );
+
+    if ( unchanged ) {
+      if (debug)
+        printf( " Mailbox \"%s\" is unchanged\n", curr_mbox->first.c_str() );
+      if ( out_of_core ) {
+        spilled_now = spilled->second;
+        spilled_lasttime.erase( spilled );
+        spilled_result = new SpilledClassification( chunk_size, *spilled_now );
+        now_n = spilled_now->size();
+        deleted_b_n = spilled_remove_b->size();
+      }
+      else {
+        msgids_now.swap( msgids_lasttime );
+        now_n = msgids_now.size();
+        deleted_b_n = remove_b.size();
+      }
+      new_n = 0;
+    }
+    else if ( out_of_core ) {
+      spilled_now = new SpilledIds( chunk_size );
+      spilled_result = new SpilledClassification( chunk_size, *spilled_now );
+      spilled_result->mirror = options.mirror;
+      classify( *spilled->second, spilled_a, spilled_b, *spilled_result );
+      now_n = spilled_now->size();
+      new_n = spilled_result->copy_a_b.size();
+      deleted_b_n = spilled_result->remove_b.size() + spilled_remove_b->size();
+    }
+    else {
+      // Sets and maps of handles iterate in handle order, so all three
+      // lists come out sorted and free of duplicates
+      vector<MsgIdHandle> ids_lasttime( msgids_lasttime.begin(),
+                                        msgids_lasttime.end() );
+      vector<MsgIdHandle> ids_a, ids_b;
+      ids_a.reserve( msgidpos_a.size() );
+      for( MsgIdPositions::iterator i = msgidpos_a.begin();
+           i != msgidpos_a.end() ;
+           i++ )
+        ids_a.push_back( i->first );
+      ids_b.reserve( msgidpos_b.size() );
+      for( MsgIdPositions::iterator i = msgidpos_b.begin();
+           i != msgidpos_b.end();
+           i++)
+        ids_b.push_back( i->first );
+
+      result.mirror = options.mirror;
+      classify( ids_lasttime, ids_a, ids_b, result );
+
+      msgids_now.insert( result.now.begin(), result.now.end() );
+      remove_a.insert( result.remove_a.begin(), result.remove_a.end() );
+      remove_b.insert( result.remove_b.begin(), result.remove_b.end() );
+      now_n = msgids_now.size();
+      new_n = result.copy_a_b.size();
+      deleted_b_n = remove_b.size();
+    }
+    sync->spilled_result = spilled_result;
+    sync->now_n = now_n;
+
+    switch (operation_mode) {
+    
+     /////////////////////////// mode_sync ///////////////////////////
+    
+     case mode_sync:
+      {
+        // Remember the message numbers of the messages to copy and remove
+        // for when the mailbox is synced, and which messages are leaving
+        // the mailbox for good - they may reappear in another mailbox.
+        // The sizes of the messages to copy are known since the scan.
+        Leaving leaving;
+        leaving.mailbox = curr_mbox->first;
+        // a mirror's source is never changed, not even to remove duplicates
+        if ( options.mirror ) {
+          remove_a.clear();
+          delete sync->duplicates_a;
+          sync->duplicates_a = new SpilledIds( chunk_size );
+        }
+        vector<MsgIdHandle>::const_iterator i;
+        MsgIdSet::const_iterator r;
+        for ( i = result.copy_a_b.begin(); i != result.copy_a_b.end(); i++ ) {
+          sync->copy_a_b[*i] = msgidpos_a[*i];
+          sync->sizes[*i] = mail_elt( store_a.stream,
+                                      msgidpos_a[*i] )->rfc822_size;
+        }
+        for ( i = result.copy_b_a.begin(); i != result.copy_b_a.end(); i++ ) {
+          sync->copy_b_a[*i] = msgidpos_b[*i];
+          sync->sizes[*i] = mail_elt( store_b.stream,
+                                      msgidpos_b[*i] )->rfc822_size;
+        }
+        for ( r = remove_a.begin(); r != remove_a.end(); r++ )
+          sync->remove_a[*r] = msgidpos_a[*r];
+        for ( r = remove_b.begin(); r != remove_b.end(); r++ )
+          sync->remove_b[*r] = msgidpos_b[*r];
+        for ( i = result.remove_a.begin(); i != result.remove_a.end(); i++ ) {
+          leaving.msgno = msgidpos_a[*i];
+          plan.leaving_a[*i] = leaving;
+        }
+        for ( i = result.remove_b.begin(); i != result.remove_b.end(); i++ ) {
+          leaving.msgno = msgidpos_b[*i];
+          plan.leaving_b[*i] = leaving;
+        }
+        if ( out_of_core ) {
+          SpilledIds::Cursor copy_a_b( spilled_result->copy_a_b );
+          for ( ; ! copy_a_b.done(); copy_a_b.next() )
+            sync->spilled_bytes_a_b += mail_elt( store_a.stream,
+                                          copy_a_b.msgno() )->rfc822_size;
+          SpilledIds::Cursor copy_b_a( spilled_result->copy_b_a );
+          for ( ; ! copy_b_a.done(); copy_b_a.next() )
+            sync->spilled_bytes_b_a += mail_elt( store_b.stream,
+                                          copy_b_a.msgno() )->rfc822_size;
+        }
+        plan.mailboxes.push_back( sync );
+        sync = NULL;
+        if (options.show_summary) {
+          printf( "scanned.\n" );
+          fflush(stdout);
+        }
+      } // end case mode_sync
+      break;
+
+     /////////////////////////// mode_diff ///////////////////////////
+    
+     case mode_diff:
+      {
+        if ( new_n )
+          printf( "%lu new, ", new_n );
+        if ( deleted_b_n )
+          printf( "%lu deleted, ", deleted_b_n );
+        printf( "%lu currently at store %s.\n",
+                now_n, store_b.name.c_str());
+      }
+      break;
+
+     default:
+      break;
+    }
+    delete sync;
+
+    if ( out_of_core )
+      spilled_thistime[curr_mbox->first] = spilled_now;
+    else
+      thistime[curr_mbox->first].swap( msgids_now );
+
+    // close local boxes
+    if (!store_a.isremote)
+      store_a.stream = mail_close(store_a.stream);
+    if (store_b.stream && !store_b.isremote)
+      store_b.stream = mail_close(store_b.stream);
+
+  } // end loop over all mailboxes
+
+  ///////////////////////////// mode_sync //////////////////////////////
+
+  if ( operation_mode == mode_sync && ! options.adopt ) {
+    plan.find_moves();
+    if ( options.simulate || debug )
+      plan.print_totals( channel, stdout );
+    if ( options.plan_out ) {
+      if (! write_plan( channel, plan, options.plan_out ) )
+        exit(1);
+    }
+    else {
+      if (! execute_plan( channel, plan, thistime, spilled_thistime,
+                          empty_mailboxes, deleted_mailboxes ) )
+        exit(1);
+      // later passes of --watch take the created mailboxes as existing
+      for ( unsigned n = 0; n < plan.create_a.size(); n++ )
+        store_a.boxes[ plan.create_a[n] ];
+      for ( unsigned n = 0; n < plan.create_b.size(); n++ )
+        store_b.boxes[ plan.create_b[n] ];
+    }
+  }
+
+  // TODO: which success are we talking about? Above there are two instances
+  //       of "success" declared which mask each other out...
+  if (!success)
+    return 1;
+
+  if ( options.delete_empty_mailboxes && operation_mode==mode_sync )
+  {
+    string fullboxname;
+
+    // remote streams are still open, they're reused
+    if (store_a.isremote) {
+      store_a.store_open( OP_HALFOPEN );
+    } else {
+      store_a.stream = NULL;
+    }
+    if (store_b.isremote) {
+      store_b.store_open( OP_HALFOPEN );
+    } else {
+      store_b.stream = NULL;
+    }
+    for ( MailboxMap::iterator mailbox = empty_mailboxes.begin() ; 
+          mailbox != empty_mailboxes.end() ;
+          mailbox++ )
+    {
+      printf("%s: deleting\n", mailbox->first.c_str());
+      if (! options.mirror) {     // a mirror's source is left alone
+        fullboxname = store_a.full_mailbox_name( mailbox->first);
+        printf("  %s", fullboxname.c_str());
+        fflush(stdout);
+        current_context_passwd = &(store_a.passwd);
+        if (mail_delete(store_a.stream, nccs(fullboxname))) {
+          printf("\n");
+          store_a.boxes.erase( mailbox->first );
+        }
+        else
+          printf(" failed\n");
+      }
+      fullboxname = store_b.full_mailbox_name( mailbox->first);
+      printf("  %s", fullboxname.c_str());
+      fflush(stdout);
+      current_context_passwd = &(store_b.passwd);
+      if (mail_delete(store_b.stream, nccs(fullboxname))) {
+        printf("\n");
+        store_b.boxes.erase( mailbox->first );
+      }
+      else
+        printf(" failed\n");
+    }
+  }
+
+  if (operation_mode==mode_sync)
+    if (!options.simulate && !options.plan_in && !options.plan_out)
+      channel.write_thistime_seen( deleted_mailboxes, thistime,
+                                   spilled_thistime);
+
+  // remove the spill files
+  for ( SpilledIdsPerMailbox::iterator i = spilled_lasttime.begin();
+        i != spilled_lasttime.end(); i++ )
+    delete i->second;
+  for ( SpilledIdsPerMailbox::iterator i = spilled_thistime.begin();
+        i != spilled_thistime.end(); i++ )
+    delete i->second;
+
+  return 0;
+}
+
+// Seconds after which --watch pings the connections to remote stores
+// that weren't used, so that they don't time out
+#define WATCH_KEEPALIVE_SECONDS (5*60)
+// Seconds after which --watch lists the mailboxes of remote stores again
+#define WATCH_LIST_SECONDS (5*60)
+
 //////////////////////////////////////////////////////////////////////////
-// The password for the current context
-// Required, because we don't know inside the c-client callback functions
-// which context (store1, store2, channel) we are in
-Passwd * current_context_passwd = NULL;
+//
+unsigned long watch_local_mailboxes( MailboxWatcher& watcher, Store& store)
+//
+// Watch the selectable maildirs and mbox files of "store" if it's local.
+// Mailboxes coming and going are looked for in the directory of the
+// store's prefix, in the directories the mailboxes are in and in
+// maildirs, which may hold submailboxes.
+//
+// Returns the number of mailboxes watched
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long n = 0;
+  if ( store.isremote )
+    return 0;
+  string path, prefix = store.full_mailbox_name( "" );
+  if ( local_mailbox_path( prefix.empty() ? "~/" : prefix, path ) )
+    watcher.watch_listing( path.substr( 0, path.rfind( '/' ) + 1 ) );
+  for ( MailboxMap::iterator box = store.boxes.begin();
+        box != store.boxes.end(); box++ ) {
+    if (! local_mailbox_path( store.full_mailbox_name( box->first ), path ) )
+      continue;
+    watcher.watch_listing( path.substr( 0, path.rfind( '/' ) + 1 ) );
+    if ( is_maildir( path ) )
+      watcher.watch_listing( path );
+    if (! box->second.no_select && watcher.watch( box->first, path ) )
+      n++;
+  }
+  return n;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void relist_mailboxes( Store& store, set<string>& found, set<string>& gone)
+//
+// List the mailboxes of "store" again. The selectable ones that weren't
+// known before are added to "found", the ones that aren't there anymore
+// to "gone" - and dropped from store.boxes, so that the next sync takes
+// them as deleted or renamed.
+//
+// If no mailbox is listed at all the old list is kept: the listing might
+// have failed, and taking all mailboxes as deleted would be fatal.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MailboxMap before;
+  before.swap( store.boxes );
+  current_context_passwd = &store.passwd;
+  store.acquire_mail_list();
+  if ( store.boxes.empty() && ! before.empty() ) {
+    fprintf( stderr, "Warning: Listing the mailboxes of %s found none,"
+                     " keeping the old list\n", store.name.c_str() );
+    store.boxes.swap( before );
+    return;
+  }
+  for ( MailboxMap::iterator box = store.boxes.begin();
+        box != store.boxes.end(); box++ )
+    if (! box->second.no_select && ! before.count( box->first ) ) {
+      if ( options.debug )
+        printf( " New mailbox %s in %s\n", box->first.c_str(),
+                store.name.c_str() );
+      found.insert( box->first );
+    }
+  for ( MailboxMap::iterator box = before.begin(); box != before.end(); box++ )
+    if (! box->second.no_select && ! store.boxes.count( box->first ) ) {
+      if ( options.debug )
+        printf( " Mailbox %s is gone from %s\n", box->first.c_str(),
+                store.name.c_str() );
+      gone.insert( box->first );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void keep_alive( Store& store)
+//
+// Ping the connection to a remote store, reconnect if it's gone
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (! store.isremote || ! store.stream )
+    return;
+  current_context_passwd = &store.passwd;
+  if (! mail_ping( store.stream ) ) {
+    store.stream = mail_close( store.stream );
+    store.store_open( OP_HALFOPEN | OP_READONLY );
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+int watch_channel( Channel& channel)
+//
+// --watch: after the first sync wait for mailboxes of the channel to
+// change and sync just the ones that did, over the connections to remote
+// stores that are already open. Local maildirs and mbox files are
+// watched with inotify, remote stores with NOTIFY or by polling their
+// status, see RemoteWatcher. Only returns on errors.
+//
+// Local stores are listed again when inotify reports entries added to or
+// removed from their directories, remote stores every WATCH_LIST_SECONDS.
+// New mailboxes are synced and watched from then on, mailboxes that are
+// gone are synced as deleted or renamed.
+//
 //////////////////////////////////////////////////////////////////////////
+{
+  Store& store_a = channel.store_a;
+  Store& store_b = channel.store_b;
+  MailboxWatcher watcher;
+  if (! watcher.available() && ( ! store_a.isremote || ! store_b.isremote ) ) {
+    fprintf( stderr, "Error: --watch needs inotify to watch local stores\n" );
+    return 1;
+  }
+  RemoteWatcher remote_a( store_a ), remote_b( store_b );
+  int timeout = WATCH_KEEPALIVE_SECONDS;
+  if ( store_a.isremote ) {
+    if (! remote_a.start() )
+      return 1;
+    if ( remote_a.interval() < timeout )
+      timeout = remote_a.interval();
+  }
+  if ( store_b.isremote ) {
+    if (! remote_b.start() )
+      return 1;
+    if ( remote_b.interval() < timeout )
+      timeout = remote_b.interval();
+  }
+
+  time_t last_sync = time( NULL );
+  time_t last_listing = last_sync;
+  for (;;) {
+    // mailboxes created by the last sync are watched from now on
+    unsigned long n = watch_local_mailboxes( watcher, store_a )
+                      + watch_local_mailboxes( watcher, store_b );
+    if ( n == 0 && ! store_a.isremote && ! store_b.isremote ) {
+      fprintf( stderr, "Error: --watch found no local maildir or mbox"
+                       " to watch\n" );
+      return 1;
+    }
+    fflush( stdout );
+
+    set<string> changed, created, gone;
+    watcher.wait( timeout, changed );
+    if ( ( store_a.isremote && ! remote_a.poll( changed ) )
+         || ( store_b.isremote && ! remote_b.poll( changed ) ) )
+      return 1;
+
+    bool list_remote = time( NULL ) - last_listing >= WATCH_LIST_SECONDS;
+    if ( watcher.entries_changed() ) {
+      if (! store_a.isremote )
+        relist_mailboxes( store_a, created, gone );
+      if (! store_b.isremote )
+        relist_mailboxes( store_b, created, gone );
+    }
+    if ( list_remote ) {
+      if ( store_a.isremote )
+        relist_mailboxes( store_a, created, gone );
+      if ( store_b.isremote )
+        relist_mailboxes( store_b, created, gone );
+      last_listing = time( NULL );
+    }
+    for ( set<string>::iterator i = created.begin(); i != created.end(); i++ ) {
+      if ( store_a.isremote && store_a.boxes.count( *i ) )
+        remote_a.watch( *i );
+      if ( store_b.isremote && store_b.boxes.count( *i ) )
+        remote_b.watch( *i );
+    }
+    for ( set<string>::iterator i = gone.begin(); i != gone.end(); i++ ) {
+      if ( store_a.isremote && ! store_a.boxes.count( *i ) )
+        remote_a.unwatch( *i );
+      if ( store_b.isremote && ! store_b.boxes.count( *i ) )
+        remote_b.unwatch( *i );
+    }
+    changed.insert( created.begin(), created.end() );
+    changed.insert( gone.begin(), gone.end() );
+
+    if ( changed.empty() ) {
+      if ( time( NULL ) - last_sync >= WATCH_KEEPALIVE_SECONDS ) {
+        keep_alive( store_a );
+        keep_alive( store_b );
+        last_sync = time( NULL );
+      }
+      continue;
+    }
+    if ( options.debug )
+      for ( set<string>::iterator i = changed.begin(); i != changed.end(); i++)
+        printf( " %s has changed\n", i->c_str() );
+    int result = sync_channel( channel, &changed );
+    if ( result != 0 )
+      return result;
+    last_sync = time( NULL );
+  }
+}
 
 //////////////////////////////////////////////////////////////////////////
 //
@@ -62,10 +1488,6 @@ int main(int argc, char** argv)
   Channel channel;
   Store& store_a = channel.store_a;
   Store& store_b = channel.store_b;
-  MsgIdsPerMailbox lasttime, thistime;
-  MailboxMap deleted_mailboxes;   // present lasttime, but not this time
-  MailboxMap empty_mailboxes;
-  int success;
   bool& debug = options.debug;
 
 #include "linkage.c"
@@ -220,402 +1642,35 @@ int main(int argc, char** argv)
     printf("\n");
   }
 
-  // Read in what mailboxes and messages we've seen the last time
-  // we've synchronized
-  if (! channel.read_lasttime_seen( lasttime, deleted_mailboxes) )
-    exit(1);    // failed to read in msinfo or similar
-
-
-  // Iterate over all mailboxes and sync or diff each
-  //
-  // our comparison operator for our stores compares lenghts
-  // that means that we're traversing the store from longest to
-  // shortest mailbox name - this makes sure that we'll first see
-  // and create mailboxes with longer "path"names that means 
-  // submailboxes first
-  success = 1; // TODO: this is bogus isn't it?
-  for ( MailboxMap::iterator curr_mbox = store_a.boxes.begin(); 
-        curr_mbox != store_b.boxes.end();
-        curr_mbox++ )
-  {
-    if ( curr_mbox == store_a.boxes.end()) { // if we're done with store_a
-      curr_mbox = store_b.boxes.begin();     // continue with store_b
-      if ( curr_mbox == store_b.boxes.end()) break;
-    }
-
-    // skip if the current mailbox has allready been synched
-    if ( curr_mbox->second.done)
-      continue;
-    
-    // if mailbox doesn't exist in either one of the stores -> create it
-    if ( store_a.boxes.find( curr_mbox->first ) == store_a.boxes.end() )
-      if ( ! store_a.mailbox_create( curr_mbox->first ) )
-        continue;
-    if ( store_b.boxes.find( curr_mbox->first ) == store_b.boxes.end() )
-      if ( ! store_b.mailbox_create( curr_mbox->first ) )
-        continue;
-
-    // when traversing store_a's boxes we don't need to worry about
-    // whether it has been synched yet or not.  It isn't unless we're
-    // in store_b that it matters whether the current mailbox has been
-    // traversed in store_a allready
-    store_b.boxes.find(curr_mbox->first)->second.done = true;
-
-    // skip unselectable (== can't contain mails) boxes
-    if ( store_a.boxes.find( curr_mbox->first )->second.no_select ) {
-      if ( debug )
-        printf( "%s is not selectable: skipping\n", curr_mbox->first.c_str() );
-      continue;
-    }
-    if ( store_b.boxes.find( curr_mbox->first )->second.no_select ) {
-      if ( debug )
-        printf( "%s is not selectable: skipping\n", curr_mbox->first.c_str() );
-      continue;
-    }
-
-    if (options.show_from)
-      printf("\n *** %s ***\n", curr_mbox->first.c_str());
-
-    MsgIdSet msgids_lasttime( lasttime[curr_mbox->first] ), msgids_union, msgids_now;
-    MsgIdPositions msgidpos_a, msgidpos_b;
-
-    if (options.show_summary) {
-      printf("%s: ",curr_mbox->first.c_str());
-      fflush(stdout);
-    }
-    else {
-      printf("\n");
-    }
-
-    // fetch_message_ids(): map message-ids to message numbers
-    //                      and optionally remember duplicates. 
-    //
-    // Attention: from here on we're operating on streams to single
-    //            _mailboxes_! That means that from here on
-    //            streamx_stream is connected to _one_ specific
-    //            mailbox.
-   
-    // Messges that should be removed in store_a respectively in store_b
-    MsgIdSet remove_a, remove_b;
-
-    // open and fetch message ID's from the mailbox in the first store
-    store_a.stream = store_a.mailbox_open( curr_mbox->first, OP_READONLY );
-    if (! store_a.stream)
-    {
-      store_a.print_error( "opening and writing", curr_mbox->first);
-      continue;
-    }
-    if (! store_a.fetch_message_ids( msgidpos_a , remove_a) )
-    {
-      store_a.print_error( "fetching of mail ids", curr_mbox->first);
-      continue;
-    }
-
-    // if we're in sync mode open and fetch message IDs from the
-    // mailbox in the second store
-    if( operation_mode == mode_sync ) {
-      store_b.stream = store_b.mailbox_open( curr_mbox->first, OP_READONLY);
-      if (! store_b.stream) {
-        store_b.print_error( "fetching of mail ids", curr_mbox->first);
-        continue;
-      }
-      if (! store_b.fetch_message_ids( msgidpos_b, remove_b )) {
-        store_b.print_error( "fetching of mail ids", curr_mbox->first);
-        continue;
-      }
-    } else if( operation_mode == mode_diff ) {
-      for( MsgIdSet::iterator i=msgids_lasttime.begin();
-           i!=msgids_lasttime.end();
-           i++ )
-      {
-           msgidpos_b[*i] = 0;
-      }
-    }
-
-    // Create the set of all seen message IDs in a mailbox:
-    // + message IDs seen the last time
-    // + message IDs seen in the mailbox from store_a
-    // + message IDs seen in the mailbox from store_b
-    // 
-    // msgids_union = union(msgids_lasttime, msgids_a, msgids_b)
-    msgids_union = msgids_lasttime;
-    for( MsgIdPositions::iterator i = msgidpos_a.begin();
-         i != msgidpos_a.end() ;
-         i++ )
-    {
-      msgids_union.insert(i->first);
-    }
-    for( MsgIdPositions::iterator i = msgidpos_b.begin();
-         i != msgidpos_b.end();
-         i++)
-    {
-      msgids_union.insert(i->first);
-    }
-
-    // Messages that should be copied from store_a to store_b,
-    // from store_b to store_a
-    MsgIdSet copy_a_b, copy_b_a;
-
-    // Iterate over all messages that were seen in a mailbox last time,
-    // in store_a and in store_b
-    for ( MsgIdSet::iterator i=msgids_union.begin();
-          i!=msgids_union.end();
-          i++ )
-    {
-      // determine first what to do with a message
-      bool in_a = msgidpos_a.count(*i);
-      bool in_b = msgidpos_b.count(*i);
-      bool in_l = msgids_lasttime.count(*i);
-
-      int a_b_l = (  (in_a ? 0x100 : 0) 
-                   + (in_b ? 0x010 : 0)
-                   + (in_l ? 0x001 : 0) );
-
-      switch (a_b_l) {
-
-      case 0x100:  // New message on a
-        copy_a_b.insert(*i);
-        msgids_now.insert(*i);
-        break;
-
-      case 0x010:  // New message on b
-        copy_b_a.insert(*i);
-        msgids_now.insert(*i);
-        break;
-
-      case 0x111:  // Kept message
-      case 0x110:  // New message, present in a and b, no copying
-                   // necessary
-        msgids_now.insert(*i);
-        break;
-
-      case 0x101:  // Deleted on b
-        remove_a.insert(*i);
-        break;
-
-      case 0x011:  // Deleted on a
-        remove_b.insert(*i);
-        break;
-
-      case 0x001:  // Deleted on both
-        break;
-
-      case 0x000:  // Shouldn't happen
-      default:
-        assert(0);
-        break;
-      }
-
-
-    }
-
-    unsigned long now_n = msgids_now.size();
-
-    switch (operation_mode) {
-    
-     /////////////////////////// mode_sync ///////////////////////////
-    
-     case mode_sync:
-      {
-        bool success;
-        unsigned long removed_a = 0, removed_b = 0, copied_a_b = 0,
-                      copied_b_a = 0;
-
-        //////////////////// copying messages ///////////////////////
-        
-        if (debug)
-          printf( " Copying messages from store \"%s\" to store \"%s\"\n",
-                  store_a.name.c_str(), store_b.name.c_str() );
-
-        if (! channel.open_for_copying( curr_mbox->first, a_to_b) )
-          exit(1);
-        for ( MsgIdSet::iterator i =copy_a_b.begin(); i !=copy_a_b.end(); i++) {
-          success = channel.copy_message( msgidpos_a[*i], *i,
-                                          curr_mbox->first, a_to_b );
-          if (success) copied_a_b++;
-          else         msgids_now.erase(*i);
-          // if we've failed to copy the message over we'll pretend that we
-          // haven't seen it at all. That way mailsync will have to rediscover
-          // and resync the same message again next time
-        }
-
-        if (debug)
-          printf( " Copying messages from store \"%s\" to store \"%s\"\n",
-                  store_b.name.c_str(), store_a.name.c_str() );
-
-        if (! channel.open_for_copying( curr_mbox->first, b_to_a) )
-          exit(1);
-        for ( MsgIdSet::iterator i=copy_b_a.begin(); i !=copy_b_a.end(); i++) {
-          success = channel.copy_message( msgidpos_b[*i], *i,
-                                          curr_mbox->first, b_to_a );
-          if (success) copied_b_a++;
-          else         msgids_now.erase(*i);
-        }
-        
-        printf("\n");
-        if (copied_a_b) printf( "%lu copied %s->%s.\n", copied_a_b,
-                                store_a.name.c_str(), store_b.name.c_str() );
-        if (copied_b_a) printf( "%lu copied %s->%s.\n", copied_b_a,
-                                store_b.name.c_str(), store_a.name.c_str() );
-        if (removed_a)  printf( "%lu deleted on %s.\n",
-                                removed_a, store_a.name.c_str() );
-        if (removed_b)  printf( "%lu deleted on %s.\n",
-                                removed_b, store_b.name.c_str() );
-        if (options.show_summary) {
-          printf( "%lu remain%s.\n", now_n, now_n != 1 ? "" : "s");
-          fflush(stdout);
-        } else {
-          printf( "%lu messages remain in %s\n",
-                  now_n, curr_mbox->first.c_str() );
-        }
-
-        //////////////////// removing messages ///////////////////////
-
-        if ( options.delete_messages && (! options.simulate) ) {
-        
-          if (debug) printf( " Removing messages from store \"%s\"\n",
-                             store_a.name.c_str() );
-
-          // TODO: check first if there are any messages to be removed before
-          //       opening
-          store_a.stream = store_a.mailbox_open( curr_mbox->first, 0 );
-          if (! store_a.stream)
-          {
-            store_a.print_error( "opening for removal ", curr_mbox->first);
-          }
-          else
-            for( MsgIdSet::iterator i =remove_a.begin(); i !=remove_a.end(); i++) {
-              success = store_a.flag_message_for_removal( msgidpos_a[*i], *i, "< ");
-              if (success) removed_a++;
-            }
-      
-          if (debug) printf( " Removing messages from store \"%s\"\n",
-                             store_b.name.c_str() );
-
-          // TODO: check first if there are any messages to be removed before
-          //       opening
-          store_b.stream = store_b.mailbox_open( curr_mbox->first, 0 );
-          if (! store_b.stream)
-          {
-            store_a.print_error( "opening for removal ", curr_mbox->first);
-          }
-          else
-            for( MsgIdSet::iterator i =remove_b.begin(); i !=remove_b.end(); i++) {
-              success = store_b.flag_message_for_removal( msgidpos_b[*i], *i, "> ");
-              if (success) removed_b++;
-            }
-
-          //////////////////////// expunging emails /////////////////////////
-          // this *needs* to be done *after* coying as the *last* step
-          // otherwise the order of the mails will get messed up since
-          // some random messages inbewteen have been deleted in the mean
-          // time and the message numbers we know don't correspond to
-          // messages in the mailbox/store any more
-        
-          if (debug) printf( " Expunging messages\n" );
-
-          int n_expunged_a = store_a.mailbox_expunge( curr_mbox->first );
-          int n_expunged_b = store_b.mailbox_expunge( curr_mbox->first );
-          if (n_expunged_a) printf( "Expunged %d mail%s in store %s\n"
-                                  , n_expunged_a
-                                  , n_expunged_a == 1 ? "" : "s"
-                                  , store_a.name.c_str() );
-          if (n_expunged_b) printf( "Expunged %d mail%s in store %s\n"
-                                  , n_expunged_b
-                                  , n_expunged_b == 1 ? "" : "s"
-                                  , store_b.name.c_str() );
-        }
-
-        //////////////////////// deleting empty mailboxes /////////////////////////
-        
-        if (options.delete_empty_mailboxes) {
-          if (now_n == 0) {
-            // add empty mailbox to empty_mailboxes
-            empty_mailboxes[ curr_mbox->first ];
-            deleted_mailboxes[ curr_mbox->first ];
-          }
-        }
-      } // end case mode_sync
-      break;
-
-     /////////////////////////// mode_diff ///////////////////////////
-    
-     case mode_diff:
-      {
-        if ( copy_a_b.size() )
-          printf( "%d new, ", copy_a_b.size() );
-        if (remove_b.size())
-          printf( "%d deleted, ", remove_b.size() );
-        printf( "%d currently at store %s.\n",
-                msgids_now.size(), store_b.name.c_str());
-      }
-      break;
-
-     default:
-      break;
-    }
+  // --plan-in carries out a sync
+  if ( options.plan_in && operation_mode != mode_sync ) {
+    fprintf( stderr, "Error: --plan-in needs a channel to sync\n" );
+    exit(1);
+  }
 
-    thistime[curr_mbox->first] = msgids_now;
+  // --adopt records what's in both stores afresh, without changing them
+  if ( options.adopt
+       && ( operation_mode != mode_sync || options.plan_in
+            || options.plan_out ) ) {
+    fprintf( stderr, "Error: --adopt needs a channel to sync and can't be"
+                     " combined with --plan-in or --plan-out\n" );
+    exit(1);
+  }
 
-    // close local boxes
-    if (!store_a.isremote)
-      store_a.stream = mail_close(store_a.stream);
-    if (store_b.stream && !store_b.isremote)
-      store_b.stream = mail_close(store_b.stream);
+  // --watch keeps syncing mailboxes as they change
+  if ( options.watch
+       && ( operation_mode != mode_sync || options.plan_in
+            || options.plan_out || options.adopt ) ) {
+    fprintf( stderr, "Error: --watch needs a channel to sync and can't be"
+                     " combined with --plan-in, --plan-out or --adopt\n" );
+    exit(1);
+  }
 
-  } // end loop over all mailboxes
+  int result = sync_channel( channel, NULL );
+  if ( result == 0 && options.watch )
+    result = watch_channel( channel );
 
   if (store_a.isremote) store_a.stream = mail_close(store_a.stream);
   if (store_b.isremote) store_b.stream = mail_close(store_b.stream);
-
-  // TODO: which success are we talking about? Above there are two instances
-  //       of "success" declared which mask each other out...
-  if (!success)
-    return 1;
-
-  if ( options.delete_empty_mailboxes && operation_mode==mode_sync )
-  {
-    string fullboxname;
-
-    if (store_a.isremote) {
-      store_a.stream = NIL;
-      store_a.store_open( OP_HALFOPEN );
-    } else {
-      store_a.stream = NULL;
-    }
-    if (store_b.isremote) {
-      store_b.stream = NIL;
-      store_b.store_open( OP_HALFOPEN );
-    } else {
-      store_b.stream = NULL;
-    }
-    for ( MailboxMap::iterator mailbox = empty_mailboxes.begin() ; 
-          mailbox != empty_mailboxes.end() ;
-          mailbox++ )
-    {
-      fullboxname = store_a.full_mailbox_name( mailbox->first);
-      printf("%s: deleting\n", mailbox->first.c_str());
-      printf("  %s", fullboxname.c_str());
-      fflush(stdout);
-      current_context_passwd = &(store_a.passwd);
-      if (mail_delete(store_a.stream, nccs(fullboxname)))
-        printf("\n");
-      else
-        printf(" failed\n");
-      fullboxname = store_b.full_mailbox_name( mailbox->first);
-      printf("  %s", fullboxname.c_str());
-      fflush(stdout);
-      current_context_passwd = &(store_b.passwd);
-      if (mail_delete(store_b.stream, nccs(fullboxname))) 
-        printf("\n");
-      else
-        printf(" failed\n");
-    }
-  }
-
-  if (operation_mode==mode_sync)
-    if (!options.simulate)
-      channel.write_thistime_seen( deleted_mailboxes, thistime);
-
-  return 0;
+  return result;
 }
@@ -1,12 +1,18 @@
 #include "config.h"
 #include <stdio.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
 #include "msgid.h"
+#include "msgid_policy.h"
 #include "options.h"
 #include "c-client-header.h"
 #include <cassert>
 #include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 
 //////////////////////////////////////////////////////////////////////////
 //
@@ -14,6 +20,10 @@
 //
 // <abcd@x.y.z>                         HEADER_MSGID format
 // <>, md5: <ABCD1234>                  MD5_MSGID format
+// <>, hash: <ABCD1234>                 HASH_MSGID format
+//
+// HASH_MSGID ids are kept in memory as the 16 bytes of the binary digest,
+// in msinfo they are written in hex.
 //
 //////////////////////////////////////////////////////////////////////////
 
@@ -38,90 +48,511 @@ extern options_t options;
  }
 #endif // HAVE_MD5
 
+#define HASHDIGLEN 16            /* HASH_MSGID digest length */
+
+//////////////////////////////////////////////////////////////////////////
+//
+class Hash128
+//
+// Incremental MurmurHash3_x64_128 by Austin Appleby (public domain)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    Hash128(): h1(0x6d61696c73796e63ULL), h2(0x6d61696c73796e63ULL),
+               buffered(0), total(0) {}
+    void update( const void* data, size_t len);
+    void update( const char* s)
+    {
+      // a field is followed by a '\0' so that fields can't run together
+      if (s)
+        update( s, strlen( s));
+      update( "", 1);
+    }
+    void final( unsigned char digest[HASHDIGLEN]);
+
+  private:
+    uint64_t h1, h2;
+    unsigned char buf[16];
+    size_t buffered;
+    uint64_t total;
+
+    static uint64_t rotl( uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t fmix( uint64_t k)
+    {
+      k ^= k >> 33;
+      k *= 0xff51afd7ed558ccdULL;
+      k ^= k >> 33;
+      k *= 0xc4ceb9fe1a85ec53ULL;
+      k ^= k >> 33;
+      return k;
+    }
+    void mix( uint64_t k1, uint64_t k2);
+};
+
+static const uint64_t c1 = 0x87c37b91114253d5ULL;
+static const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+//////////////////////////////////////////////////////////////////////////
+//
+void Hash128::mix( uint64_t k1, uint64_t k2)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  k1 *= c1; k1 = rotl( k1, 31); k1 *= c2; h1 ^= k1;
+  h1 = rotl( h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+  k2 *= c2; k2 = rotl( k2, 33); k2 *= c1; h2 ^= k2;
+  h2 = rotl( h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void Hash128::update( const void* data, size_t len)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  const unsigned char* p = (const unsigned char*) data;
+  uint64_t k1, k2;
+
+  total += len;
+  if (buffered) {
+    size_t n = min( len, sizeof(buf) - buffered);
+    memcpy( buf + buffered, p, n);
+    buffered += n;
+    p += n;
+    len -= n;
+    if (buffered < sizeof(buf))
+      return;
+    memcpy( &k1, buf, 8);
+    memcpy( &k2, buf + 8, 8);
+    mix( k1, k2);
+    buffered = 0;
+  }
+  for ( ; len >= 16; p += 16, len -= 16) {
+    memcpy( &k1, p, 8);
+    memcpy( &k2, p + 8, 8);
+    mix( k1, k2);
+  }
+  memcpy( buf, p, len);
+  buffered = len;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void Hash128::final( unsigned char digest[HASHDIGLEN])
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  uint64_t k1 = 0, k2 = 0;
+
+  switch (buffered) {
+    case 15: k2 ^= (uint64_t) buf[14] << 48;
+    case 14: k2 ^= (uint64_t) buf[13] << 40;
+    case 13: k2 ^= (uint64_t) buf[12] << 32;
+    case 12: k2 ^= (uint64_t) buf[11] << 24;
+    case 11: k2 ^= (uint64_t) buf[10] << 16;
+    case 10: k2 ^= (uint64_t) buf[9] << 8;
+    case  9: k2 ^= (uint64_t) buf[8];
+             k2 *= c2; k2 = rotl( k2, 33); k2 *= c1; h2 ^= k2;
+    case  8: k1 ^= (uint64_t) buf[7] << 56;
+    case  7: k1 ^= (uint64_t) buf[6] << 48;
+    case  6: k1 ^= (uint64_t) buf[5] << 40;
+    case  5: k1 ^= (uint64_t) buf[4] << 32;
+    case  4: k1 ^= (uint64_t) buf[3] << 24;
+    case  3: k1 ^= (uint64_t) buf[2] << 16;
+    case  2: k1 ^= (uint64_t) buf[1] << 8;
+    case  1: k1 ^= (uint64_t) buf[0];
+             k1 *= c1; k1 = rotl( k1, 31); k1 *= c2; h1 ^= k1;
+  }
+  h1 ^= total; h2 ^= total;
+  h1 += h2; h2 += h1;
+  h1 = fmix( h1); h2 = fmix( h2);
+  h1 += h2; h2 += h1;
+  for (int i = 0; i < 8; i++) {
+    digest[i]     = (unsigned char) (h1 >> (56 - 8*i));
+    digest[8 + i] = (unsigned char) (h2 >> (56 - 8*i));
+  }
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+//////////////////////////////////////////////////////////////////////////
+//
+static string to_hex( const string& binary)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  string hex( 2 * binary.length(), '0');
+  for (size_t i = 0; i < binary.length(); i++) {
+    hex[2*i]     = hex_digits[ (unsigned char) binary[i] >> 4 ];
+    hex[2*i + 1] = hex_digits[ (unsigned char) binary[i] & 0xf ];
+  }
+  return hex;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static string from_hex( const string& hex)
+//
+// Returns an empty string if "hex" isn't a hex encoded digest
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (hex.length() != 2 * HASHDIGLEN)
+    return "";
+  string binary( HASHDIGLEN, '\0');
+  for (size_t i = 0; i < hex.length(); i++) {
+    const char* d = strchr( hex_digits, tolower( hex[i]));
+    if (! d || ! *d)
+      return "";
+    binary[i/2] |= (d - hex_digits) << (i % 2 ? 0 : 4);
+  }
+  return binary;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void hash_addresses( Hash128& hash, ADDRESS* a)
+//
+// Feed the parts of each address, that rfc822_address() would print, to
+// "hash" - without formatting them first
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for ( ; a; a = a->next) {
+    hash.update( a->adl);
+    hash.update( a->mailbox);
+    hash.update( a->host);
+  }
+}
+
+
 //////////////////////////////////////////////////////////////////////////
 //
 MsgId::MsgId(ENVELOPE *envelope)
 //
 // Create a message id from an envelope
 //
-// depending on the options that are set we use one of the methods for
-// generating a message identificator.
+// In HEADER_MSGID mode messages without Message-ID get "<>", use
+// MsgId( stream, msgno, envelope) to get their content derived id
 //
-// Currently there are two methods:
+// depending on the options that are set we use one of the methods for
+// generating a message identificator, see msgid_policy.h
 //
-// HEADER_MSGID       - use the Message-ID header provided in the mailheader
-// MD5_MSGID          - make a md5 hash from the From, To, Subject, Date
-//                      and Message-ID fields
+// The per message loops call the policies directly
 //
 //////////////////////////////////////////////////////////////////////////
 {
-  string str;
-
   switch( options.msgid_type) {
-
    case (HEADER_MSGID) :
-        if ( envelope->message_id
-             && strcmp( envelope->message_id, "") != 0 
-             && strcmp( envelope->message_id, "<>") != 0 )
-          *this = envelope->message_id;
-        else
-          *this = "<>";         // empty message-id
-        sanitize_message_id();
-        // some software produces empty Message-IDs f.ex. for draft emails
-        // which makes us unable to differentiaty between such messages
-        if ( *this == "<>") {
-          printf( "Warning: empty Message-ID header in message From: \"%s\" "
-                  "Subject: \"%s\" - please consult the README\n",
-                  (envelope->from && envelope->from->mailbox)
-                  ? envelope->from->mailbox : "",
-                  envelope->subject ? envelope->subject : "");
-        }
+        *this = HeaderIdentity::from_envelope( envelope);
         break;
 #ifdef HAVE_MD5
    case (MD5_MSGID) :
-        char addr[4096];
-
-        if (envelope->date)
-          str = string((char*)envelope->date);
-        if (envelope->subject)
-          str += string(envelope->subject);
-        if (envelope->message_id)
-          str += string(envelope->message_id);
-        for (ADDRESS *a = envelope->from; a; a = a->next) {
-          *addr = '\0';
-          rfc822_address(addr,a);
-          str += string(addr);
-        }
-        for (ADDRESS *a = envelope->to; a; a = a->next) {
-          *addr = '\0';
-          rfc822_address(addr,a);
-          str += string(addr);
-        }
-        if (str.length() != 0) {
-          unsigned char bdigest[MD5DIGLEN];
-          MD5CONTEXT ctx;
-          char cdigest[2 * MD5DIGLEN + 2];
-
-          md5_init(&ctx);
-          md5_update(&ctx, (unsigned char *) str.c_str(), strlen(str.c_str()) );
-          md5_final(bdigest, &ctx);
-          for (int i = 0; i < MD5DIGLEN; i++)
-            sprintf(&cdigest[2 * i],"%02x",bdigest[i]);
-          cdigest[2 * MD5DIGLEN] = '\0';
-          *this = cdigest;
-        }
+        *this = Md5Identity::from_envelope( envelope);
         break;
 #endif // HAVE_MD5
-   
+   case (HASH_MSGID) :
+        *this = HashIdentity::from_envelope( envelope);
+        break;
    default :
         assert(0);      // this should not happen
         break;
   }
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+MsgId HeaderIdentity::from_envelope( ENVELOPE *envelope)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MsgId msgid;
+
+  if ( envelope->message_id
+       && strcmp( envelope->message_id, "") != 0 
+       && strcmp( envelope->message_id, "<>") != 0 )
+    msgid = envelope->message_id;
+  else
+    msgid = "<>";         // empty message-id
+  msgid.sanitize_message_id();
+  // some software produces empty Message-IDs f.ex. for draft emails
+  // which makes us unable to differentiaty between such messages by
+  // their header - see from_message()
+  if ( msgid == "<>" && options.log_warn ) {
+    printf( "Warning: empty Message-ID header in message From: \"%s\" "
+            "Subject: \"%s\" - please consult the README\n",
+            (envelope->from && envelope->from->mailbox)
+            ? envelope->from->mailbox : "",
+            envelope->subject ? envelope->subject : "");
+  }
+  return msgid;
+}
+
+#ifdef HAVE_MD5
+//////////////////////////////////////////////////////////////////////////
+//
+MsgId Md5Identity::from_envelope( ENVELOPE *envelope)
+//
+// Also used for migrating msinfo from MD5_MSGID to HASH_MSGID
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  string str;
+  char addr[4096];
+
+  if (envelope->date)
+    str = string((char*)envelope->date);
+  if (envelope->subject)
+    str += string(envelope->subject);
+  if (envelope->message_id)
+    str += string(envelope->message_id);
+  for (ADDRESS *a = envelope->from; a; a = a->next) {
+    *addr = '\0';
+    rfc822_address(addr,a);
+    str += string(addr);
+  }
+  for (ADDRESS *a = envelope->to; a; a = a->next) {
+    *addr = '\0';
+    rfc822_address(addr,a);
+    str += string(addr);
+  }
+  if (str.length() == 0)
+    return MsgId();
+
+  unsigned char bdigest[MD5DIGLEN];
+  MD5CONTEXT ctx;
+  char cdigest[2 * MD5DIGLEN + 2];
+
+  md5_init(&ctx);
+  md5_update(&ctx, (unsigned char *) str.c_str(), strlen(str.c_str()) );
+  md5_final(bdigest, &ctx);
+  for (int i = 0; i < MD5DIGLEN; i++)
+    sprintf(&cdigest[2 * i],"%02x",bdigest[i]);
+  cdigest[2 * MD5DIGLEN] = '\0';
+  return MsgId( cdigest);
+}
+#endif // HAVE_MD5
+
+//////////////////////////////////////////////////////////////////////////
+//
+MsgId HeaderIdentity::from_message( MAILSTREAM* stream, unsigned long msgno,
+                                    ENVELOPE* envelope)
+//
+// Like from_envelope(), but messages without Message-ID get a content
+// derived message id, see content_msgid()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MsgId msgid = from_envelope( envelope);
+  if ( msgid.empty() )
+    msgid = content_msgid( stream, msgno, envelope);
+  return msgid;
+}
+
+static const string content_msgid_domain = "@mailsync.invalid>";
+
+//////////////////////////////////////////////////////////////////////////
+//
+MsgId content_msgid( MAILSTREAM* stream, unsigned long msgno,
+                     ENVELOPE* envelope)
+//
+// Synthesize a message id for a message without Message-ID header from
+// its Date, From and Subject headers, its size and its internal date.
+// mailsync keeps the internal date when copying, so the id is the same
+// in both stores.
+//
+// The result looks like <0123456789abcdef0123456789abcdef@mailsync.invalid>
+//
+// The internal date goes in as UTC seconds and both numbers as 8 bytes,
+// least significant first, so the id doesn't depend on the time zone a
+// server keeps internal dates in nor on the word size of the host.
+//
+// The size and internal date come from the message cache. Drivers that
+// don't fill the cache together with the envelope (IMAP) get them for
+// the whole mailbox with a single FETCH FAST the first time they're
+// missing - message bodies are never downloaded.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MESSAGECACHE* elt = mail_elt( stream, msgno);
+  if ( ! elt->day || ! elt->rfc822_size ) {
+    char seq[30];
+    sprintf( seq, "1:%lu", stream->nmsgs);
+    mail_fetch_fast( stream, seq, NIL);
+    elt = mail_elt( stream, msgno);
+  }
+
+  Hash128 hash;
+  unsigned char digest[HASHDIGLEN];
+  unsigned char numbers[16];
+  uint64_t size = elt->rfc822_size;
+  uint64_t date = mail_longdate( elt);
+
+  for (int i = 0; i < 8; i++) {
+    numbers[i] = (unsigned char) (size >> (8 * i));
+    numbers[8 + i] = (unsigned char) (date >> (8 * i));
+  }
+  hash.update( (char*) envelope->date);
+  hash_addresses( hash, envelope->from);
+  hash.update( "", 1);
+  hash.update( envelope->subject);
+  hash.update( numbers, sizeof(numbers));
+  hash.final( digest);
+  return MsgId( "<" + to_hex( string( (char*) digest, HASHDIGLEN))
+                + content_msgid_domain);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+MsgId HashIdentity::from_envelope( ENVELOPE *envelope)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  MsgId msgid;
+
+  if ( envelope->date || envelope->subject || envelope->message_id
+       || envelope->from || envelope->to ) {
+    Hash128 hash;
+    unsigned char digest[HASHDIGLEN];
+
+    hash.update( (char*) envelope->date);
+    hash.update( envelope->subject);
+    hash.update( envelope->message_id);
+    hash_addresses( hash, envelope->from);
+    hash.update( "", 1);
+    hash_addresses( hash, envelope->to);
+    hash.final( digest);
+    msgid.assign( (char*) digest, HASHDIGLEN);
+  }
+  return msgid;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+string HashIdentity::to_msinfo( const string& msgid)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( msgid.length() == 2 * HASHDIGLEN )       // not yet migrated
+    return "<>, md5: <" + msgid + ">";
+  return "<>, hash: <" + to_hex( msgid) + ">";
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+string HashIdentity::from_msinfo( const string& entry)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  string::size_type start = entry.find(">, md5: <");
+  if ( start != string::npos ) {
+    start += 9;                         // 9 == length of ">, md5: <"
+    return entry.substr( start, entry.find( ">", start) - start);
+  }
+  start = entry.find(">, hash: <") + 10; // 10 == length of ">, hash: <"
+  return from_hex( entry.substr( start, entry.find( ">", start) - start));
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+MsgId::MsgId( MAILSTREAM* stream, unsigned long msgno, ENVELOPE *envelope)
+//
+// Create the message id of message "msgno" in "stream" - the same id
+// that the mailbox scan sees
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( options.msgid_type == HEADER_MSGID )
+    *this = HeaderIdentity::from_message( stream, msgno, envelope);
+  else
+    *this = MsgId( envelope);
+}
+
 static char const* const fixup_names[] = { 
   "removed blanks", "added angle brackets", "added square brackets around ip address" };
 
+//////////////////////////////////////////////////////////////////////////
+//
+static inline bool is_blank( unsigned char c)
+//
+// isspace() || iscntrl() in the "C" locale that mailsync runs in
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  return c <= ' ' || c == 0x7f;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static size_t scan_message_id( char* s, size_t len, bool& blanks)
+//
+// Replace blanks by '.' up to the first '>' and return the position of
+// that '>', or "len" if there is none.
+//
+// With SSE2 16 bytes are classified at a time. Most message ids don't
+// contain any blanks, so mostly this is a search for '>'.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i gt = _mm_set1_epi8( '>');
+  const __m128i space = _mm_set1_epi8( ' ');
+  const __m128i del = _mm_set1_epi8( 0x7f);
+  for ( ; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128( (const __m128i*) (s + i));
+    // unsigned v <= ' ' is min( v, ' ') == v
+    __m128i blank = _mm_or_si128(
+                      _mm_cmpeq_epi8( _mm_min_epu8( v, space), v),
+                      _mm_cmpeq_epi8( v, del));
+    unsigned end_mask = _mm_movemask_epi8( _mm_cmpeq_epi8( v, gt));
+    unsigned blank_mask = _mm_movemask_epi8( blank);
+    if (end_mask)
+      blank_mask &= (end_mask & -end_mask) - 1;  // only before the '>'
+    if (blank_mask) {
+      blanks = true;
+      for (unsigned j = 0; j < 16; j++)
+        if (blank_mask & (1u << j))
+          s[i + j] = '.';
+    }
+    if (end_mask)
+      return i + __builtin_ctz( end_mask);
+  }
+#endif // __SSE2__
+  for ( ; i < len && s[i] != '>'; i++) {
+    if (is_blank( s[i])) {
+      s[i] = '.';
+      blanks = true;
+    }
+  }
+  return i;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool is_ip_literal( const char* s, size_t len)
+//
+// Say whether s[0..len) is a dotted quad like 1.2.3.4 - digits and exactly
+// three dots, none of them adjacent
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  int dots = 0;
+  if (len < strlen("1.1.1.1") || len > strlen("255.255.255.255"))
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] == '.') {
+      if (i > 0 && s[i-1] == '.')
+        return false;
+      dots++;
+    }
+    else if (s[i] < '0' || s[i] > '9')
+      return false;
+  }
+  return dots == 3;
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 void MsgId::sanitize_message_id()
@@ -139,48 +570,37 @@ void MsgId::sanitize_message_id()
 // the msgid). If we don't find the ending '>' we just put a ">" at the end
 // of the msgid.
 //
+// The message id is repaired in place, well formed ids aren't copied.
+//
 //////////////////////////////////////////////////////////////////////////
 {
   enum { 
     removed_blanks, added_angle_brackets, added_square_brackets, num_fixups };
   bool fixup[num_fixups] = {};
-  unsigned i;
-  if ((*this)[0] != '<') {
-    *this = '<'+ *this;
+  if (string::empty() || (*this)[0] != '<') {
+    insert( (size_type) 0, 1, '<');
     fixup[added_angle_brackets] = true;
   }
-  for (i=0; (i < this->length()) && ((*this)[i] != '>'); i++) {
-    if (isspace((*this)[i]) || iscntrl((*this)[i])) {
-      (*this)[i] = '.';
-      fixup[removed_blanks] = true;
-    }
-  }
 
-  // Have we reached end of string?
-  if (i == this->size()) {
-  // if there's no '>' we need to attach
-    if((*this)[i-1] != '>') {
-      *this = *this + '>';
-      fixup[added_angle_brackets] = true;
-    }
+  size_type i = scan_message_id( &(*this)[0], length(),
+                                 fixup[removed_blanks]);
+  if (i == length()) {
+    // if there's no '>' we need to attach
+    push_back( '>');
+    fixup[added_angle_brackets] = true;
   }
   // we've found a '>', so let's cut the rubbish that follows
   else
-    *this = this->substr( 0, i+1);
+    resize( i + 1);
 
   // Look for un-bracketed ip addresses
   size_type atsign_pos = this->rfind('@');
   if (atsign_pos != npos) {
     size_type tail_pos = atsign_pos + 1;
-    size_type tail_end = this->size() - 1;
-    size_type tail_length = tail_end - tail_pos;
-    if (tail_length >= strlen("1.1.1.1") 
-        && tail_length <= strlen("255.255.255.255")
-        && this->find_first_not_of("0123456789.", tail_pos) == tail_end
-        && std::count(this->begin() + tail_pos, this->end(), '.') == 3
-        && this->find("..", tail_pos) == npos
-    ) {
-      *this = this->substr(0,tail_pos) + '[' + this->substr(tail_pos,tail_length) + "]>";
+    size_type tail_length = length() - 1 - tail_pos;
+    if (is_ip_literal( data() + tail_pos, tail_length)) {
+      insert( tail_pos, 1, '[');
+      insert( length() - 1, 1, ']');
       fixup[added_square_brackets] = true;
     }
   }
@@ -209,31 +629,20 @@ string MsgId::from_msinfo_format()
 // Read from a msinfo entry the relevant msgid depending on which 
 // format is currently chosen
 //
-// Currently there are two formats:
-//
-// HEADER_MSGID       - message id as in the Message-ID header in a mailheader
-// MD5_MSGID          - message id in md5 hash format
-//
 //////////////////////////////////////////////////////////////////////////
 {
-  int start;
-
   switch( options.msgid_type) {
-
    case (HEADER_MSGID) :
-        return this->substr(0, this->find(">") + 1);
-        break;
-
+        return HeaderIdentity::from_msinfo( *this);
 #ifdef HAVE_MD5
    case (MD5_MSGID) :
-        start = this->find(">, md5: <") + 9; // 9 == length of ">, md5: <"
-        return this->substr( start, this->find( ">", start) - start);
-        break;
+        return Md5Identity::from_msinfo( *this);
 #endif // HAVE_MD5
-   
+   case (HASH_MSGID) :
+        return HashIdentity::from_msinfo( *this);
    default :
         assert(0);      // this should not happen
-        break;
+        return "";
   }
 }
 
@@ -243,28 +652,20 @@ string MsgId::to_msinfo_format()
 //
 // Return the message id in msinfo format
 //
-// Currently there are two formats:
-//
-// HEADER_MSGID       - message id as in the Message-ID header in a mailheader
-// MD5_MSGID          - message id in md5 hash format
-//
 //////////////////////////////////////////////////////////////////////////
 {
   switch( options.msgid_type) {
-
    case (HEADER_MSGID) :
-        return *this;
-        break;
-
+        return HeaderIdentity::to_msinfo( *this);
 #ifdef HAVE_MD5
    case (MD5_MSGID) :
-        return "<>, md5: <" + *this + ">";
-        break;
+        return Md5Identity::to_msinfo( *this);
 #endif // HAVE_MD5
-   
+   case (HASH_MSGID) :
+        return HashIdentity::to_msinfo( *this);
    default :
         assert(0);      // this should not happen
-        break;
+        return "";
   }
 }
 
@@ -279,3 +680,60 @@ bool MsgId::empty()
 {
   return string::empty() || *this == "<>";
 }
+
+//////////////////////////////////////////////////////////////////////////
+//
+string MsgId::printable() const
+//
+// Return the message id in a form that can be shown to the user
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( options.msgid_type == HASH_MSGID && length() == HASHDIGLEN )
+    return to_hex( *this);
+  return *this;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+MsgId MsgId::from_printable( const string& printed)
+//
+// Undo printable(). The md5 ids of an msinfo that isn't migrated yet
+// are printed as they are, but they're never part of a scan.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( options.msgid_type == HASH_MSGID ) {
+    string binary = from_hex( printed);
+    if (! binary.empty())
+      return MsgId( binary);
+  }
+  return MsgId( printed);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MsgId::is_md5_msgid() const
+//
+// Say whether a HASH_MSGID message id is really an md5 id read from an
+// old msinfo that still needs to be migrated. The two are told apart by
+// their length: 32 hex characters vs 16 bytes.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  return options.msgid_type == HASH_MSGID && length() == 2 * HASHDIGLEN;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MsgId::is_content_msgid() const
+//
+// Say whether the message id was made up by content_msgid()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  return length() > content_msgid_domain.length()
+         && compare( length() - content_msgid_domain.length(),
+                     content_msgid_domain.length(),
+                     content_msgid_domain) == 0;
+}
@@ -19,11 +19,25 @@ class MsgId : public string
     MsgId(char* m): string(m) {};
     MsgId(string m): string(m) {};
     MsgId(ENVELOPE *envelope);
+    MsgId(MAILSTREAM* stream, unsigned long msgno, ENVELOPE *envelope);
     void sanitize_message_id();
     string to_msinfo_format();
     string from_msinfo_format();
+    string printable() const;
+    static MsgId from_printable( const string& printed);
+    bool is_md5_msgid() const;
+    bool is_content_msgid() const;
     bool empty();
 };
 
+//////////////////////////////////////////////////////////////////////////
+//
+MsgId content_msgid( MAILSTREAM* stream, unsigned long msgno,
+                     ENVELOPE* envelope);
+//
+// Message id for messages that don't have a Message-ID header
+//
+//////////////////////////////////////////////////////////////////////////
+
 #define __MAILSYNC_MSGID__
 #endif
@@ -0,0 +1,121 @@
+#ifndef __MAILSYNC_MSGID_POLICY__
+
+#include "config.h"
+#include <string>
+#include "c-client-header.h"
+#include "options.h"
+#include "msgid.h"
+
+using namespace std;
+
+extern options_t options;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Message identity policies
+//
+// Each msgid_t is implemented by a policy type with static members only:
+//
+// from_envelope( envelope)   - the message id of a message
+// from_message( stream, msgno, envelope)
+//                            - the same, for messages that can be
+//                              identified without a Message-ID header
+// to_msinfo( msgid)          - the message id as written to msinfo
+// from_msinfo( entry)        - the message id from a msinfo entry
+//
+// The per message loops (scanning a mailbox, reading and writing msinfo)
+// are templates on the policy. They are instantiated once per policy and
+// IDENTITY_DISPATCH picks the instance once, so there's no switch on
+// options.msgid_type per message. A new identity scheme is a new policy
+// plus a case in IDENTITY_DISPATCH.
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+struct HeaderIdentity
+//
+// HEADER_MSGID - use the Message-ID header provided in the mailheader
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  static MsgId from_envelope( ENVELOPE* envelope);
+  static MsgId from_message( MAILSTREAM* stream, unsigned long msgno,
+                             ENVELOPE* envelope);
+  static string to_msinfo( const string& msgid) { return msgid; }
+  static string from_msinfo( const string& entry)
+  {
+    return entry.substr(0, entry.find(">") + 1);
+  }
+};
+
+#ifdef HAVE_MD5
+//////////////////////////////////////////////////////////////////////////
+//
+struct Md5Identity
+//
+// MD5_MSGID - make a md5 hash from the From, To, Subject, Date and
+//             Message-ID fields
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  static MsgId from_envelope( ENVELOPE* envelope);
+  static MsgId from_message( MAILSTREAM*, unsigned long, ENVELOPE* envelope)
+  {
+    return from_envelope( envelope);
+  }
+  static string to_msinfo( const string& msgid)
+  {
+    return "<>, md5: <" + msgid + ">";
+  }
+  static string from_msinfo( const string& entry)
+  {
+    string::size_type start = entry.find(">, md5: <") + 9; // ">, md5: <"
+    return entry.substr( start, entry.find( ">", start) - start);
+  }
+};
+#endif // HAVE_MD5
+
+//////////////////////////////////////////////////////////////////////////
+//
+struct HashIdentity
+//
+// HASH_MSGID - same fields as MD5_MSGID, hashed with the much faster
+//              128 bit MurmurHash3. md5 entries from an old msinfo are
+//              passed through in hex, see MsgId::is_md5_msgid()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  static MsgId from_envelope( ENVELOPE* envelope);
+  static MsgId from_message( MAILSTREAM*, unsigned long, ENVELOPE* envelope)
+  {
+    return from_envelope( envelope);
+  }
+  static string to_msinfo( const string& msgid);
+  static string from_msinfo( const string& entry);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+// IDENTITY_DISPATCH( function, (arguments) )
+//
+// return function<Policy>(arguments) for the policy selected with "-t"
+//
+//////////////////////////////////////////////////////////////////////////
+#ifdef HAVE_MD5
+ #define IDENTITY_DISPATCH_MD5( f, args) \
+   case MD5_MSGID:    return f<Md5Identity> args;
+#else
+ #define IDENTITY_DISPATCH_MD5( f, args)
+#endif // HAVE_MD5
+
+#define IDENTITY_DISPATCH( f, args) \
+  switch( options.msgid_type) { \
+    IDENTITY_DISPATCH_MD5( f, args) \
+    case HASH_MSGID:   return f<HashIdentity> args; \
+    case HEADER_MSGID: \
+    default:           return f<HeaderIdentity> args; \
+  }
+
+#define __MAILSYNC_MSGID_POLICY__
+#endif
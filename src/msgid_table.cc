@@ -0,0 +1,132 @@
+#include <string.h>
+#include "msgid_table.h"
+
+static const MsgIdHandle no_handle = 0xffffffff;
+
+//////////////////////////////////////////////////////////////////////////
+//
+uint64_t hash_msgid( const char* s, size_t len)
+//
+// MurmurHash64A by Austin Appleby (public domain)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  const unsigned char* data = (const unsigned char*) s;
+  const unsigned char* end = data + (len & ~(size_t) 7);
+  uint64_t h = 0x6d61696c73796e63ULL ^ (len * m);   // "mailsync"
+
+  for ( ; data != end; data += 8) {
+    uint64_t k;
+    memcpy( &k, data, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  switch (len & 7) {
+    case 7: h ^= (uint64_t) data[6] << 48;
+    case 6: h ^= (uint64_t) data[5] << 40;
+    case 5: h ^= (uint64_t) data[4] << 32;
+    case 4: h ^= (uint64_t) data[3] << 24;
+    case 3: h ^= (uint64_t) data[2] << 16;
+    case 2: h ^= (uint64_t) data[1] << 8;
+    case 1: h ^= (uint64_t) data[0];
+            h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// MsgIdTable
+//
+//////////////////////////////////////////////////////////////////////////
+MsgIdTable::MsgIdTable(): arena(), entries(), slots(1024, no_handle) {}
+
+//////////////////////////////////////////////////////////////////////////
+//
+size_t MsgIdTable::slot_of( uint64_t hash, const char* s, size_t len) const
+//
+// Return the slot that either contains "s" or where "s" should be inserted
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  size_t mask = slots.size() - 1;
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    MsgIdHandle h = slots[i];
+    if (h == no_handle)
+      return i;
+    const Entry& e = entries[h];
+    if (e.hash == hash && e.length == len
+        && memcmp( &arena[e.offset], s, len) == 0)
+      return i;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void MsgIdTable::grow()
+//
+// Double the hash index. Keeps the load factor below 1/2
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  vector<MsgIdHandle> bigger( slots.size() * 2, no_handle);
+  slots.swap( bigger);
+  size_t mask = slots.size() - 1;
+  for (MsgIdHandle h = 0; h < entries.size(); h++) {
+    size_t i = entries[h].hash & mask;
+    while (slots[i] != no_handle)
+      i = (i + 1) & mask;
+    slots[i] = h;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+MsgIdHandle MsgIdTable::intern( const char* s, size_t len)
+//
+// Return the handle of message id "s", adding it if it's new
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  uint64_t hash = hash_msgid( s, len);
+  size_t i = slot_of( hash, s, len);
+  if (slots[i] != no_handle)
+    return slots[i];
+
+  Entry e;
+  e.hash = hash;
+  e.offset = arena.size();
+  e.length = len;
+  arena.insert( arena.end(), s, s + len);
+  arena.push_back( '\0');
+  entries.push_back( e);
+  slots[i] = entries.size() - 1;
+
+  if (2 * entries.size() > slots.size())
+    grow();
+  return entries.size() - 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MsgIdTable::find( const string& msgid, MsgIdHandle& handle) const
+//
+// Look up "msgid" without adding it
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  size_t i = slot_of( hash_msgid( msgid.data(), msgid.length()),
+                      msgid.data(), msgid.length());
+  if (slots[i] == no_handle)
+    return false;
+  handle = slots[i];
+  return true;
+}
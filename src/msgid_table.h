@@ -0,0 +1,83 @@
+#ifndef __MAILSYNC_MSGID_TABLE__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "msgid.h"
+
+using namespace std;
+
+typedef uint32_t MsgIdHandle;
+
+//////////////////////////////////////////////////////////////////////////
+//
+uint64_t hash_msgid( const char* s, size_t len);
+//
+// 64 bit hash of a message id. The hash is stable between runs and
+// platforms, so it may be stored in msinfo
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+class MsgIdTable
+//
+// Interning table for message ids
+//
+// Each distinct message id is stored exactly once in an arena and is
+// referenced everywhere else by a 32 bit handle. The per mailbox sets and
+// maps only contain handles, so comparing two message ids is an integer
+// comparison.
+//
+// Handles stay valid for the lifetime of the table. Pointers returned by
+// data() are only valid until the next call to intern().
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    MsgIdTable();
+
+    MsgIdHandle intern( const char* s, size_t len);
+    MsgIdHandle intern( const string& msgid)
+    {
+      return intern( msgid.data(), msgid.length());
+    }
+    bool find( const string& msgid, MsgIdHandle& handle) const;
+
+    MsgId msgid( MsgIdHandle handle) const
+    {
+      return MsgId( string( data( handle), length( handle)));
+    }
+    const char* data( MsgIdHandle handle) const
+    {
+      return &arena[ entries[handle].offset ];
+    }
+    size_t length( MsgIdHandle handle) const
+    {
+      return entries[handle].length;
+    }
+    uint64_t hash( MsgIdHandle handle) const
+    {
+      return entries[handle].hash;
+    }
+    size_t size() const { return entries.size(); }
+
+  private:
+    struct Entry {
+      uint64_t hash;
+      uint32_t offset;                  // into arena
+      uint32_t length;                  // without the terminating '\0'
+    };
+    vector<char> arena;                 // '\0' terminated message ids
+    vector<Entry> entries;              // indexed by handle
+    vector<MsgIdHandle> slots;          // open addressing hash index
+
+    size_t slot_of( uint64_t hash, const char* s, size_t len) const;
+    void grow();
+};
+
+// the table that all message ids of a run are interned in
+extern MsgIdTable msgid_table;
+
+#define __MAILSYNC_MSGID_TABLE__
+#endif
@@ -0,0 +1,351 @@
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#ifdef HAVE_ZLIB
+ #include <zlib.h>
+#endif
+#include "c-client-header.h"   // rfc822_binary, rfc822_base64
+#include "msinfo_encoding.h"
+
+//////////////////////////////////////////////////////////////////////////
+//
+// The compressed msinfo body consists of one marker line followed by
+// base64 encoded data:
+//
+// mailsync-msinfo: fc1 <deflate|raw> <length of the decompressed data>
+// <base64 data>
+//
+// The decompressed data is a sequence of variable length integers (7 bits
+// per byte, least significant first, high bit set on all but the last byte)
+// and byte strings:
+//
+// <number of domains> { <length> <domain> }
+// <number of mailboxes>
+//   { <length> <mailbox name> <number of entries>
+//     { <shared> <length> <suffix> <domain code> } }
+//
+// Each entry is split into a stem and, if it ends in a "@domain>" that is
+// used by more than one entry, the domain. The stem is stored as the
+// number of leading bytes <shared> with the previous stem of the same
+// mailbox plus the remaining <suffix>. <domain code> is 0 if the domain is
+// part of the stem or the index into the domain list plus one.
+//
+//////////////////////////////////////////////////////////////////////////
+
+static const char marker[] = "mailsync-msinfo: fc1 ";
+
+// deflate doesn't compress anything better than about 1032:1, a larger
+// decompressed length in the header can only come from a corrupt msinfo
+#define MAX_DEFLATE_RATIO 1032
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void put_number( string& out, unsigned long n)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  while (n >= 0x80) {
+    out += (char) ((n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  out += (char) n;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void put_bytes( string& out, const char* s, unsigned long len)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  put_number( out, len);
+  out.append( s, len);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool get_number( const string& in, string::size_type& pos,
+                        unsigned long& n)
+//
+// Returns false if "in" ends prematurely
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned shift = 0;
+  n = 0;
+  while (pos < in.size()) {
+    unsigned char c = in[pos++];
+    n |= (unsigned long) (c & 0x7f) << shift;
+    if (! (c & 0x80))
+      return true;
+    shift += 7;
+    if (shift >= 8 * sizeof(n))
+      return false;
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool get_bytes( const string& in, string::size_type& pos, string& s)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long len;
+  if (! get_number( in, pos, len) || len > in.size() - pos)
+    return false;
+  s.assign( in, pos, len);
+  pos += len;
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static string::size_type domain_start( const string& entry)
+//
+// Return the position of the "@domain>" tail of "entry" or npos
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (entry.empty() || entry[entry.size()-1] != '>')
+    return string::npos;
+  return entry.rfind('@');
+}
+
+struct more_frequent
+{
+  bool operator()( const pair<string, unsigned long>& d1,
+                   const pair<string, unsigned long>& d2) const
+  {
+    if (d1.second == d2.second)
+      return d1.first < d2.first;
+    return d1.second > d2.second;
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool write_encoded_msinfo( FILE* f, const MsinfoSections& sections)
+//
+// Front code, dictionary encode, deflate and base64 encode "sections"
+// and write them to "f"
+//
+// Returns false on failure
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  string data;
+  map<string, unsigned long> domain_count;
+  map<string, unsigned long> domain_code;
+  vector< pair<string, unsigned long> > domains;
+
+  // Build the domain dictionary from all domains used more than once
+  for (MsinfoSections::const_iterator section = sections.begin();
+       section != sections.end(); section++)
+    for (vector<string>::const_iterator entry = section->second.begin();
+         entry != section->second.end(); entry++)
+    {
+      string::size_type at = domain_start( *entry);
+      if (at != string::npos)
+        domain_count[ entry->substr(at) ]++;
+    }
+  for (map<string, unsigned long>::iterator d = domain_count.begin();
+       d != domain_count.end(); d++)
+    if (d->second > 1)
+      domains.push_back( *d);
+  sort( domains.begin(), domains.end(), more_frequent());
+
+  put_number( data, domains.size());
+  for (unsigned long i = 0; i < domains.size(); i++) {
+    put_bytes( data, domains[i].first.data(), domains[i].first.size());
+    domain_code[ domains[i].first ] = i + 1;
+  }
+
+  // Front code the entries of each mailbox
+  put_number( data, sections.size());
+  for (MsinfoSections::const_iterator section = sections.begin();
+       section != sections.end(); section++)
+  {
+    string previous;
+    put_bytes( data, section->first.data(), section->first.size());
+    put_number( data, section->second.size());
+    for (vector<string>::const_iterator entry = section->second.begin();
+         entry != section->second.end(); entry++)
+    {
+      string::size_type stem_len = entry->size();
+      unsigned long code = 0;
+      string::size_type at = domain_start( *entry);
+      if (at != string::npos) {
+        map<string, unsigned long>::iterator d =
+                                domain_code.find( entry->substr(at));
+        if (d != domain_code.end()) {
+          code = d->second;
+          stem_len = at;
+        }
+      }
+      string::size_type shared = 0;
+      while (shared < stem_len && shared < previous.size()
+             && (*entry)[shared] == previous[shared])
+        shared++;
+      put_number( data, shared);
+      put_bytes( data, entry->data() + shared, stem_len - shared);
+      put_number( data, code);
+      previous.assign( *entry, 0, stem_len);
+    }
+  }
+
+  const char* method = "raw";
+  string packed = data;
+#ifdef HAVE_ZLIB
+  {
+    uLongf packed_len = compressBound( data.size());
+    vector<Bytef> buf( packed_len);
+    if (compress2( &buf[0], &packed_len, (const Bytef*) data.data(),
+                   data.size(), Z_BEST_COMPRESSION) != Z_OK)
+    {
+      fprintf( stderr, "Error: Can't compress msinfo\n");
+      return false;
+    }
+    packed.assign( (const char*) &buf[0], packed_len);
+    method = "deflate";
+  }
+#endif // HAVE_ZLIB
+
+  unsigned long b64_len;
+  unsigned char* b64 = (unsigned char*) rfc822_binary(
+                                      (void*) packed.data(), packed.size(),
+                                      &b64_len);
+  if (! b64) {
+    fprintf( stderr, "Error: Can't base64 encode msinfo\n");
+    return false;
+  }
+  fprintf( f, "%s%s %lu\n", marker, method, (unsigned long) data.size());
+  // c-client terminates its base64 lines with CRLF, msinfo uses LF
+  for (unsigned long i = 0; i < b64_len; i++)
+    if (b64[i] != '\r')
+      fputc( b64[i], f);
+  fs_give( (void**) &b64);
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool is_encoded_msinfo( const char* text, unsigned long textlen)
+//
+// Say whether the msinfo body "text" is in the compressed encoding
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  return textlen >= strlen( marker)
+         && strncmp( text, marker, strlen( marker)) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool decode_msinfo( const char* text, unsigned long textlen,
+                    string& plain)
+//
+// Decode the compressed msinfo body "text" into "plain"
+//
+// Returns false if "text" is corrupt
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  char method[16];
+  unsigned long data_len;
+  const char* eol = (const char*) memchr( text, '\n', textlen);
+
+  if (! eol
+      || sscanf( text + strlen( marker), "%15s %lu", method, &data_len) != 2)
+  {
+    fprintf( stderr, "Error: Malformed compressed msinfo header\n");
+    return false;
+  }
+  eol++;
+
+  unsigned long packed_len;
+  unsigned char* packed = (unsigned char*) rfc822_base64(
+                                      (unsigned char*) eol,
+                                      textlen - (eol - text), &packed_len);
+  if (! packed) {
+    fprintf( stderr, "Error: Can't base64 decode msinfo\n");
+    return false;
+  }
+
+  string data;
+  if (strcmp( method, "raw") == 0)
+    data.assign( (const char*) packed, packed_len);
+#ifdef HAVE_ZLIB
+  else if (strcmp( method, "deflate") == 0) {
+    if (data_len / MAX_DEFLATE_RATIO > packed_len) {
+      fprintf( stderr, "Error: Compressed msinfo is corrupt\n");
+      fs_give( (void**) &packed);
+      return false;
+    }
+    uLongf len = data_len;
+    vector<Bytef> buf( data_len + 1);
+    if (uncompress( &buf[0], &len, packed, packed_len) != Z_OK
+        || len != data_len)
+    {
+      fprintf( stderr, "Error: Can't decompress msinfo\n");
+      fs_give( (void**) &packed);
+      return false;
+    }
+    data.assign( (const char*) &buf[0], len);
+  }
+#endif // HAVE_ZLIB
+  else {
+    fprintf( stderr, "Error: Unsupported msinfo compression \"%s\"\n",
+                     method);
+    fs_give( (void**) &packed);
+    return false;
+  }
+  fs_give( (void**) &packed);
+
+  // Undo the dictionary and front coding
+  string::size_type pos = 0;
+  unsigned long n_domains, n_sections;
+  vector<string> domains;
+
+  plain = "";
+  // every domain takes at least the byte of its length
+  if (! get_number( data, pos, n_domains) || n_domains > data.size() - pos)
+    goto corrupt;
+  domains.resize( n_domains);
+  for (unsigned long i = 0; i < n_domains; i++)
+    if (! get_bytes( data, pos, domains[i]))
+      goto corrupt;
+
+  if (! get_number( data, pos, n_sections))
+    goto corrupt;
+  for (unsigned long s = 0; s < n_sections; s++) {
+    string name, previous, suffix;
+    unsigned long n_entries;
+
+    if (! get_bytes( data, pos, name) || ! get_number( data, pos, n_entries))
+      goto corrupt;
+    plain += name + '\n';
+    for (unsigned long e = 0; e < n_entries; e++) {
+      unsigned long shared, code;
+      if (! get_number( data, pos, shared)
+          || shared > previous.size()
+          || ! get_bytes( data, pos, suffix)
+          || ! get_number( data, pos, code)
+          || code > domains.size())
+        goto corrupt;
+      previous = previous.substr( 0, shared) + suffix;
+      plain += previous;
+      if (code)
+        plain += domains[code - 1];
+      plain += '\n';
+    }
+  }
+  return true;
+
+ corrupt:
+  fprintf( stderr, "Error: Compressed msinfo is corrupt\n");
+  return false;
+}
@@ -0,0 +1,56 @@
+#ifndef __MAILSYNC_MSINFO_ENCODING__
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Compressed ("front coded") msinfo encoding
+//
+// See doc/HACKING for a description of the encoded format.
+//
+//////////////////////////////////////////////////////////////////////////
+
+enum msinfo_format_t { msinfo_text, msinfo_compressed };
+
+// A mailbox name together with all its entries in msinfo format
+typedef pair< string, vector<string> > MsinfoSection;
+typedef vector< MsinfoSection > MsinfoSections;
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool write_encoded_msinfo( FILE* f, const MsinfoSections& sections);
+//
+// Front code, dictionary encode, deflate and base64 encode "sections"
+// and write them to "f"
+//
+// Returns false on failure
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool is_encoded_msinfo( const char* text, unsigned long textlen);
+//
+// Say whether the msinfo body "text" is in the compressed encoding
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool decode_msinfo( const char* text, unsigned long textlen,
+                    string& plain);
+//
+// Decode the compressed msinfo body "text" into "plain", which will then
+// contain exactly what the plain text format would have contained: each
+// mailbox name on a line followed by its entries, one per line
+//
+// Returns false if "text" is corrupt
+//
+//////////////////////////////////////////////////////////////////////////
+
+#define __MAILSYNC_MSINFO_ENCODING__
+#endif
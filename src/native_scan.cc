@@ -0,0 +1,519 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include "msgid.h"
+#include "msgid_table.h"
+#include "native_scan.h"
+#include "utils.h"
+
+// Bytes an mbox file is read in at a time by mbox_digest()
+#define MBOX_READ_SIZE 65536
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool local_mailbox_path( const string& mailbox, string& path)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  path = mailbox;
+  // "#driver.maildir/box" names the driver explicitly
+  if ( path.compare( 0, 8, "#driver." ) == 0 ) {
+    string::size_type slash = path.find( '/' );
+    if ( slash == string::npos )
+      return false;
+    path = path.substr( slash + 1 );
+  }
+  if ( path.empty() || path[0] == '#' || path[0] == '{' )
+    return false;
+  // c-client takes relative names relative to the home directory
+  const char* home = getenv( "HOME" );
+  if ( path[0] == '~' && path.length() > 1 && path[1] == '/' ) {
+    if (! home)
+      return false;
+    path = string( home ) + path.substr( 1 );
+  }
+  else if ( path[0] != '/' ) {
+    if (! home)
+      return false;
+    path = string( home ) + "/" + path;
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool is_maildir( const string& path)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  struct stat st;
+  return stat( (path + "/cur").c_str(), &st ) == 0 && S_ISDIR( st.st_mode )
+         && stat( (path + "/new").c_str(), &st ) == 0 && S_ISDIR( st.st_mode );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool is_mbox( const string& path)
+//
+// An mbox is empty or starts with a "From " line
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  struct stat st;
+  if ( stat( path.c_str(), &st ) != 0 || ! S_ISREG( st.st_mode ) )
+    return false;
+  if ( st.st_size == 0 )
+    return true;
+  int fd = open( path.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return false;
+  char start[5];
+  bool is = read( fd, start, 5 ) == 5 && memcmp( start, "From ", 5 ) == 0;
+  close( fd );
+  return is;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static string stat_fingerprint( const struct stat& st, time_t& modified)
+//
+// Inode, size and modification time of a file or directory, as text
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  char buf[120];
+  long nsec = 0;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  nsec = st.st_mtim.tv_nsec;
+#endif
+  sprintf( buf, "%lu %llu %ld.%09ld", (unsigned long) st.st_ino,
+           (unsigned long long) st.st_size, (long) st.st_mtime, nsec );
+  if ( st.st_mtime > modified )
+    modified = st.st_mtime;
+  return buf;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool count_entries( const string& dir, unsigned long& n)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  DIR* d = opendir( dir.c_str() );
+  if (! d)
+    return false;
+  struct dirent* entry;
+  n = 0;
+  while ( (entry = readdir( d )) )
+    if ( entry->d_name[0] != '.' )
+      n++;
+  closedir( d );
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool mailbox_fingerprint( const string& path, string& fingerprint,
+                          time_t& modified)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  struct stat st;
+  char count[30];
+  modified = 0;
+  if ( is_maildir( path ) ) {
+    fingerprint = "maildir";
+    const char* subdirs[] = { "/cur", "/new" };
+    for ( int i = 0; i < 2; i++ ) {
+      unsigned long n;
+      string dir = path + subdirs[i];
+      if ( stat( dir.c_str(), &st ) != 0 || ! count_entries( dir, n ) )
+        return false;
+      sprintf( count, " %lu", n );
+      fingerprint += " " + stat_fingerprint( st, modified ) + count;
+    }
+    return true;
+  }
+  if ( is_mbox( path ) && stat( path.c_str(), &st ) == 0 ) {
+    fingerprint = "mbox " + stat_fingerprint( st, modified );
+    return true;
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool surely_changed( const string& path, const string& fingerprint,
+                     const string& fingerprint_before,
+                     unsigned long messages_before)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long ino, ino_before, n_cur, n_new;
+  unsigned long long size, size_before;
+  if ( sscanf( fingerprint.c_str(), "maildir %*u %*u %*s %lu %*u %*u %*s %lu",
+               &n_cur, &n_new ) == 2 )
+    return n_cur + n_new != messages_before;
+
+  if ( sscanf( fingerprint.c_str(), "mbox %lu %llu", &ino, &size ) != 2 )
+    return false;
+  if ( size == 0 )
+    return messages_before != 0;
+  if ( sscanf( fingerprint_before.c_str(), "mbox %lu %llu",
+               &ino_before, &size_before ) != 2
+       || ino != ino_before || size <= size_before )
+    return false;
+
+  // appended messages start where the file used to end
+  int fd = open( path.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return false;
+  char from[5];
+  bool appended = pread( fd, from, 5, size_before ) == 5
+                  && memcmp( from, "From ", 5 ) == 0;
+  close( fd );
+  return appended;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void header_message_id( const char* header, size_t len,
+                               string& msgid)
+//
+// Get the - unfolded - value of the first Message-ID header in "header"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  const char* end = header + len;
+  bool in_msgid = false, found = false;
+  msgid.clear();
+  while ( header < end ) {
+    const char* eol = (const char*) memchr( header, '\n', end - header );
+    if (! eol)
+      eol = end;
+    const char* line_end = eol;
+    if ( line_end > header && line_end[-1] == '\r' )
+      line_end--;
+
+    if ( header < line_end && (*header == ' ' || *header == '\t') ) {
+      if ( in_msgid )
+        msgid.append( header, line_end - header );
+    }
+    else if ( found )
+      break;
+    else if ( line_end - header >= 11
+              && strncasecmp( header, "message-id:", 11 ) == 0 ) {
+      msgid.assign( header + 11, line_end - header - 11 );
+      in_msgid = found = true;
+    }
+    header = eol + 1;
+  }
+
+  // trim the blanks c-client drops as well
+  string::size_type first = msgid.find_first_not_of( " \t" );
+  string::size_type last = msgid.find_last_not_of( " \t" );
+  msgid = first == string::npos ? string()
+                                : msgid.substr( first, last - first + 1 );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool digest_of_ids( const vector<string>& msgids, SetDigest& digest)
+//
+// Sanitize the Message-ID header values "msgids" like c-client's
+// envelopes and add them to "digest"
+//
+// Returns false if one is missing or there are duplicates
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  set<string> seen;
+  for ( unsigned long i = 0; i < msgids.size(); i++ ) {
+    if ( msgids[i].empty() || msgids[i] == "<>" )
+      return false;
+    MsgId msgid( msgids[i] );
+    msgid.sanitize_message_id();
+    if (! seen.insert( msgid ).second )
+      return false;
+    digest.add( hash_msgid( msgid.data(), msgid.length() ));
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool list_messages( const string& dir, vector<string>& files)
+//
+// Append the message files in "dir" to "files"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  DIR* d = opendir( dir.c_str() );
+  if (! d)
+    return false;
+  struct dirent* entry;
+  while ( (entry = readdir( d )) )
+    if ( entry->d_name[0] != '.' )
+      files.push_back( dir + "/" + entry->d_name );
+  closedir( d );
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool read_message_id( const string& file, string& msgid)
+//
+// Read the header of the message in "file" up to the blank line that ends
+// it and get the - unfolded - value of its first Message-ID header. The
+// body isn't read.
+//
+// Returns false if the file can't be read
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  int fd = open( file.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return false;
+
+  string header;
+  string::size_type end = string::npos;
+  char buf[4096];
+  ssize_t n;
+  while ( end == string::npos && (n = read( fd, buf, sizeof(buf) )) > 0 ) {
+    string::size_type from = header.length() > 2 ? header.length() - 2 : 0;
+    header.append( buf, n );
+    end = header.find( "\n\n", from );
+    if ( end == string::npos )
+      end = header.find( "\n\r\n", from );
+  }
+  close( fd );
+  if ( n < 0 )
+    return false;
+  if ( end == string::npos )
+    end = header.length();
+  header_message_id( header.data(), end, msgid );
+  return true;
+}
+
+// Share of the files of a maildir one thread reads
+struct ScanJob
+{
+  const vector<string>* files;
+  vector<string>* msgids;
+  vector<char>* readable;
+  unsigned long first, step;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void* scan_files( void* data)
+//
+// Read every "step"th file, starting with "first"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  ScanJob* job = (ScanJob*) data;
+  for ( unsigned long i = job->first; i < job->files->size(); i += job->step )
+    (*job->readable)[i] = read_message_id( (*job->files)[i],
+                                           (*job->msgids)[i] );
+  return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool scan_maildir( const string& path, vector<string>& files,
+                          vector<string>& msgids)
+//
+// List the message files of the maildir "path" and read the Message-ID
+// header values of the messages in them, in parallel
+//
+// Returns false if a file can't be read
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (! list_messages( path + "/cur", files )
+      || ! list_messages( path + "/new", files ) )
+    return false;
+
+  msgids.assign( files.size(), string() );
+  vector<char> readable( files.size(), 0 );
+  unsigned threads = 1;
+#ifdef HAVE_PTHREAD
+  threads = MAILDIR_SCAN_THREADS;
+  if ( files.size() < 4 * threads )
+    threads = 1;
+#endif // HAVE_PTHREAD
+  vector<ScanJob> jobs( threads );
+  vector<void*> job_ptrs( threads );
+  for ( unsigned t = 0; t < threads; t++ ) {
+    jobs[t].files = &files;
+    jobs[t].msgids = &msgids;
+    jobs[t].readable = &readable;
+    jobs[t].first = t;
+    jobs[t].step = threads;
+    job_ptrs[t] = &jobs[t];
+  }
+  run_in_threads( scan_files, job_ptrs );
+
+  for ( unsigned long i = 0; i < files.size(); i++ )
+    if (! readable[i] )
+      return false;
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool maildir_digest( const string& path, SetDigest& digest)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  vector<string> files, msgids;
+  // sanitizing may print, so that's done here rather than in the threads
+  return scan_maildir( path, files, msgids )
+         && digest_of_ids( msgids, digest );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool maildir_files( const string& path, map<string, string>& files)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  vector<string> names, msgids;
+  if (! scan_maildir( path, names, msgids ) )
+    return false;
+  for ( unsigned long i = 0; i < names.size(); i++ ) {
+    if ( msgids[i].empty() || msgids[i] == "<>" )
+      continue;
+    MsgId msgid( msgids[i] );
+    msgid.sanitize_message_id();
+    files.insert( make_pair( msgid, names[i] ) );
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool is_from_line( const char* line, const char* end)
+//
+// Say whether "line" is a "From " line that separates messages. Like
+// c-client we want a time in it, so that "From " at the start of a line
+// of text - if it wasn't quoted - isn't taken for one
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  const char* eol = (const char*) memchr( line, '\n', end - line );
+  if (! eol)
+    eol = end;
+  if ( eol - line < 5 || memcmp( line, "From ", 5 ) != 0 )
+    return false;
+  for ( const char* p = line + 5; p + 5 <= eol; p++ )
+    if ( isdigit( p[0] ) && isdigit( p[1] ) && p[2] == ':'
+         && isdigit( p[3] ) && isdigit( p[4] ) )
+      return true;
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void mbox_header_done( const string& header, bool first,
+                              vector<string>& msgids)
+//
+// Take the Message-ID of the message whose "header" has been read. c-client
+// hides the pseudo message keeping its UIDs at the start of the file.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( first && ( header.compare( 0, 6, "X-IMAP" ) == 0
+                  || header.find( "\nX-IMAP" ) != string::npos ) )
+    return;
+  msgids.push_back( string() );
+  header_message_id( header.data(), header.length(), msgids.back() );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool mbox_digest( const string& path, SetDigest& digest)
+//
+// The file is read with read() rather than mapped into memory: an MUA may
+// expunge from it meanwhile, and touching a mapping beyond the end of a
+// file that shrank raises SIGBUS. A file that changes under the scan
+// merely gives a wrong digest, so the mailbox counts as changed.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  int fd = open( path.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+  vector<string> msgids;
+  string header;                // of the current message, while it's read
+  bool in_header = false, started = false, ok = true, eof = false;
+  unsigned long messages = 0;
+  string data;                  // read, but not split into lines yet
+  string::size_type pos = 0;
+  char buf[MBOX_READ_SIZE];
+  while ( ok ) {
+    string::size_type eol = data.find( '\n', pos );
+    if ( eol == string::npos && ! eof ) {
+      data.erase( 0, pos );
+      pos = 0;
+      ssize_t n = read( fd, buf, sizeof(buf) );
+      if ( n < 0 )
+        ok = false;
+      else if ( n == 0 )
+        eof = true;
+      else
+        data.append( buf, n );
+      continue;
+    }
+    if ( eol == string::npos ) {
+      if ( pos == data.length() )
+        break;
+      eol = data.length() - 1;          // the last line lacks its newline
+    }
+    const char* line = data.data() + pos;
+    string::size_type len = eol + 1 - pos;
+    pos = eol + 1;
+
+    // a message ends where the next "From " line starts
+    if ( is_from_line( line, line + len ) ) {
+      if ( in_header )
+        mbox_header_done( header, messages == 1, msgids );
+      header.clear();
+      in_header = started = true;
+      messages++;
+    }
+    else if (! started )
+      ok = false;                       // not an mbox after all
+    // its header follows the "From " line, up to the first empty line
+    else if ( in_header ) {
+      if ( ( len == 1 && line[0] == '\n' )
+           || ( len == 2 && line[0] == '\r' && line[1] == '\n' ) ) {
+        mbox_header_done( header, messages == 1, msgids );
+        in_header = false;
+      }
+      else
+        header.append( line, len );
+    }
+  }
+  if ( ok && in_header )
+    mbox_header_done( header, messages == 1, msgids );
+  close( fd );
+  return ok && digest_of_ids( msgids, digest );
+}
@@ -0,0 +1,116 @@
+#ifndef __MAILSYNC_NATIVE_SCAN__
+
+#include <time.h>
+#include <string>
+#include <map>
+#include "set_digest.h"
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Native scanning of local mailboxes
+//
+// c-client reads the whole header of every message into an ENVELOPE
+// just to get at its Message-ID, and opening an mbox makes it parse and
+// index the whole file. For local maildirs and mbox files mailsync can
+// read the Message-ID headers itself:
+//
+// - the files in cur/ and new/ of a maildir are read up to the end of
+//   their headers only, by several threads if pthreads are available
+// - an mbox file is read in chunks and split into lines, looking for
+//   "From " lines and the headers following them
+//
+// That gives the message ids, but not reliably the message numbers
+// c-client will assign. So the native scan is only used to recognize
+// mailboxes that still hold the messages of last time - they aren't
+// opened with c-client at all. Otherwise the mailbox is scanned by
+// c-client as usual, which also does all the writing.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Number of threads reading the files of a maildir
+#define MAILDIR_SCAN_THREADS 8
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool local_mailbox_path( const string& mailbox, string& path);
+//
+// Find the file or directory of the local mailbox with the full name
+// "mailbox", the way c-client does
+//
+// Returns false if "mailbox" isn't a plain local name
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool is_maildir( const string& path);
+bool is_mbox( const string& path);
+//
+// Say whether "path" is a maildir, i.e. has a cur/ and a new/
+// subdirectory, respectively an mbox file
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool mailbox_fingerprint( const string& path, string& fingerprint,
+                          time_t& modified);
+//
+// A cheap fingerprint of the maildir or mbox "path" that changes whenever
+// messages are added to or removed from it: the modification times and
+// numbers of entries of cur/ and new/ respectively the inode, size and
+// modification time of the mbox file. Nothing but directories is read.
+//
+// "modified" is set to the latest modification time. A fingerprint is
+// only to be trusted if that was before the current second - changes
+// within the same second may leave it as it is.
+//
+// Returns false if "path" is neither or can't be read
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool surely_changed( const string& path, const string& fingerprint,
+                     const string& fingerprint_before,
+                     unsigned long messages_before);
+//
+// Say whether the maildir or mbox "path" with "fingerprint" certainly
+// doesn't hold the "messages_before" messages anymore that it held when
+// its fingerprint was "fingerprint_before" - "" if that isn't known. A
+// maildir has another number of entries in cur/ and new/, messages were
+// appended to an mbox file. A native scan of such a mailbox is in vain,
+// c-client is going to scan it anyway.
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool maildir_digest( const string& path, SetDigest& digest);
+bool mbox_digest( const string& path, SetDigest& digest);
+//
+// Compute the digest of the message ids in the maildir respectively mbox
+// "path" the way Store::fetch_message_ids does for HEADER_MSGID
+//
+// Return false if that isn't possible natively: the mailbox can't be
+// read, a message has no Message-ID (its id would be derived from its
+// content) or there are duplicates (which are to be removed)
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool maildir_files( const string& path, map<string, string>& files);
+//
+// Map the message ids in the maildir "path" to the files holding the
+// messages. Messages without Message-ID are left out, of duplicates the
+// first file found is taken.
+//
+// Returns false if the maildir can't be read
+//
+//////////////////////////////////////////////////////////////////////////
+
+#define __MAILSYNC_NATIVE_SCAN__
+#endif
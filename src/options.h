@@ -5,7 +5,7 @@ using namespace std;
 // hierarchy delimiter for IMAP
 #define DEFAULT_DELIMITER '/'
 
-typedef enum { HEADER_MSGID, MD5_MSGID } msgid_t;
+typedef enum { HEADER_MSGID, MD5_MSGID, HASH_MSGID } msgid_t;
 
 //////////////////////////////////////////////////////////////////////////
 // Options, commandline parsing and default settings
@@ -27,6 +27,19 @@ typedef struct options_t {
   bool copy_deleted_messages;
   bool simulate;
   msgid_t msgid_type;
+  unsigned long max_memory;    // Bytes of message ids per mailbox to keep
+                               // in memory, 0 is unlimited (--max-memory)
+  const char* plan_out;        // Save the sync plan there instead of
+                               // carrying it out (--plan-out)
+  const char* plan_in;         // Carry out the plan saved there instead of
+                               // scanning the mailboxes (--plan-in)
+  bool mirror;                 // Only sync a to b, trusting msinfo for
+                               // what b holds (--mirror)
+  bool verify;                 // Scan b when mirroring anyway (--verify)
+  bool adopt;                  // Take the messages in both stores as
+                               // synced, without copying (--adopt)
+  bool watch;                  // Keep syncing local mailboxes as they
+                               // change (--watch)
 
   // the following options are mandatory
   bool expunge_duplicates;     // Should duplicates be deleted?
@@ -47,6 +60,13 @@ typedef struct options_t {
                copy_deleted_messages(0),
                simulate(0),
                msgid_type(HEADER_MSGID),
+               max_memory(0),
+               plan_out(0),
+               plan_in(0),
+               mirror(0),
+               verify(0),
+               adopt(0),
+               watch(0),
                expunge_duplicates(1),
                log_error(1) {};
 };
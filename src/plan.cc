@@ -0,0 +1,1198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <set>
+#include <map>
+#include <sys/stat.h>
+#include "plan.h"
+#include "options.h"
+#include "store.h"
+#include "mail_handling.h"
+#include "c-client-header.h"
+#include "native_scan.h"
+#include "maildir.h"
+
+extern options_t options;
+extern Passwd*     current_context_passwd;
+
+//////////////////////////////////////////////////////////////////////////
+//
+class PositionedIds
+//
+// Walks message id handles together with their positions in a mailbox -
+// the in memory counterpart of SpilledIds::Cursor
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    PositionedIds( const MsgIdPositions& ids):
+      i(ids.begin()), end(ids.end()) {}
+    bool done() const            { return i == end; }
+    MsgId key() const            { return msgid_table.msgid(i->first); }
+    unsigned long msgno() const  { return i->second; }
+    void next()                  { i++; }
+  private:
+    MsgIdPositions::const_iterator i, end;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void match_moves( const string& mailbox, const MsgIdPositions& copy,
+                         LeavingIndex& leaving, MovesPerMailbox& moves)
+//
+// A message that was moved from one mailbox to another in one store shows
+// up as removed from the old mailbox and as new in the other mailbox.
+// Instead of copying it over from the other store it can be moved within
+// the store it's already in.
+//
+// Match the messages to "copy" into "mailbox" with the messages "leaving"
+// the other mailboxes of the target store and record them in "moves"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for ( MsgIdPositions::const_iterator i = copy.begin(); i != copy.end(); i++)
+  {
+    LeavingIndex::iterator from = leaving.find( i->first );
+    if ( from == leaving.end() || from->second.mailbox == mailbox )
+      continue;
+    moves[ from->second.mailbox ][ i->first ] = from->second.msgno;
+    leaving.erase( from );
+  }
+}
+
+// Length after which a message sequence isn't extended any further - IMAP
+// servers limit the length of command lines, some to 1000 bytes
+#define MAX_SEQUENCE_LENGTH 800
+
+//////////////////////////////////////////////////////////////////////////
+//
+static unsigned long move_messages( Store& store, const string& mailbox,
+                                    const MovesPerMailbox& moves,
+                                    MsgIdPositions& copy)
+//
+// Copy the messages in "moves" from the other mailboxes of "store" into
+// "mailbox" with one copy per mailbox - on the server if the store is
+// remote. The originals are removed along with the rest of the removals
+// in their mailbox. Runs of consecutive messages are given as ranges,
+// and if there are too many of them the copy is split up.
+//
+// Moved messages are taken off "copy", the list of messages that would
+// otherwise be copied over from the other store.
+//
+// Returns the number of moved messages
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long moved = 0;
+
+  for ( MovesPerMailbox::const_iterator from = moves.begin();
+        from != moves.end(); from++ )
+  {
+    store.stream = store.mailbox_open( from->first, OP_READONLY );
+    if (! store.stream) {
+      store.print_error( "moving messages out of", from->first );
+      continue;
+    }
+
+    vector< pair<unsigned long, MsgIdHandle> > found;  // by msgno
+    for ( MsgIdPositions::const_iterator i = from->second.begin();
+          i != from->second.end(); i++ )
+    {
+      // make sure the message numbers are still the ones we've scanned
+      ENVELOPE* envelope = mail_fetchenvelope( store.stream, i->second );
+      if (! envelope
+          || MsgId( store.stream, i->second, envelope )
+             != msgid_table.msgid( i->first ) )
+        continue;
+      found.push_back( make_pair( i->second, i->first ) );
+    }
+    sort( found.begin(), found.end() );
+
+    for ( unsigned long n = 0; n < found.size(); ) {
+      string sequence;
+      unsigned long first = n;
+      while ( n < found.size() && sequence.length() < MAX_SEQUENCE_LENGTH ) {
+        unsigned long last = n;
+        while ( last + 1 < found.size()
+                && found[last + 1].first == found[last].first + 1 )
+          last++;
+        char range[60];
+        if ( last == n )
+          sprintf( range, "%s%lu", sequence.empty() ? "" : ",",
+                   found[n].first );
+        else
+          sprintf( range, "%s%lu:%lu", sequence.empty() ? "" : ",",
+                   found[n].first, found[last].first );
+        sequence += range;
+        n = last + 1;
+      }
+      if ( store.messages_copy( sequence, mailbox ) ) {
+        for ( unsigned long m = first; m < n; m++ )
+          copy.erase( found[m].second );
+        moved += n - first;
+      }
+    }
+  }
+
+  if (store.stream && !store.isremote)
+    store.stream = mail_close(store.stream);
+  return moved;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class List>
+static unsigned long copy_messages( Channel& channel, const string& mailbox,
+                                    enum direction_t direction, List& list,
+                                    vector<MsgId>& failed)
+//
+// Copy all messages in "list", remember the ones that failed
+//
+// Returns the number of copied messages
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long copied = 0;
+  for ( ; ! list.done(); list.next()) {
+    if ( channel.copy_message( list.msgno(), list.key(), mailbox, direction) )
+      copied++;
+    else
+      failed.push_back( list.key() );
+  }
+  return copied - channel.finish_copying( failed );
+}
+
+// Limits of a batch of messages appended at once
+#define BULK_BATCH_MESSAGES 500
+#define BULK_BATCH_BYTES    (32*1024*1024)
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class List>
+static unsigned long bulk_copy_messages( Channel& channel,
+                                         const string& mailbox,
+                                         enum direction_t direction,
+                                         const ScanState& scanned,
+                                         List& list, vector<MsgId>& failed)
+//
+// Copy all messages in "list" in batches, for the initial sync of a
+// mailbox, remember the ones that failed
+//
+// Their message ids aren't checked before copying, so if the mailbox
+// doesn't look as "scanned" anymore, they're copied one by one after all
+//
+// Returns the number of copied messages
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Store& store_from = (direction == a_to_b) ? channel.store_a
+                                            : channel.store_b;
+  unsigned long copied = 0;
+
+  if (! scanned.matches( store_from.stream ) ) {
+    if (options.debug)
+      printf( " %s in %s has changed since it was scanned\n",
+              mailbox.c_str(), store_from.name.c_str() );
+    return copy_messages( channel, mailbox, direction, list, failed );
+  }
+
+  // fetch the flags, sizes and dates of all messages at once
+  current_context_passwd = &store_from.passwd;
+  mail_fetch_fast( store_from.stream, nccs( "1:*" ), NIL );
+
+  while (! list.done()) {
+    vector<unsigned long> msgnos;
+    vector<MsgId> ids;
+    vector<bool> appended;
+    unsigned long long bytes = 0;
+    for ( ; ! list.done() && msgnos.size() < BULK_BATCH_MESSAGES
+            && bytes < BULK_BATCH_BYTES; list.next()) {
+      msgnos.push_back( list.msgno() );
+      ids.push_back( list.key() );
+      bytes += mail_elt( store_from.stream, list.msgno() )->rfc822_size;
+    }
+    channel.append_messages( msgnos, ids, mailbox, direction, appended );
+    for ( unsigned long n = 0; n < ids.size(); n++ )
+      if ( appended[n] )
+        copied++;
+      else
+        failed.push_back( ids[n] );
+  }
+  return copied - channel.finish_copying( failed );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool local_maildirs( Channel& channel, const string& mailbox,
+                            enum direction_t direction,
+                            string& from, string& to)
+//
+// Say whether "mailbox" is a local maildir in both stores and find their
+// directories
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Store& store_from = (direction == a_to_b) ? channel.store_a
+                                            : channel.store_b;
+  Store& store_to   = (direction == a_to_b) ? channel.store_b
+                                            : channel.store_a;
+  return ! store_from.isremote && ! store_to.isremote
+         && local_mailbox_path( store_from.full_mailbox_name( mailbox ), from )
+         && local_mailbox_path( store_to.full_mailbox_name( mailbox ), to )
+         && is_maildir( from ) && is_maildir( to );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class List>
+static unsigned long copy_files( Channel& channel,
+                                 const map<string, string>& files,
+                                 MaildirWriter& writer,
+                                 enum direction_t direction, List& list,
+                                 vector<MsgId>& failed,
+                                 MsgIdPositions& elsewhere)
+//
+// Copy the messages in "list" from one local maildir to another as
+// files, found by their message ids in "files". The messages are
+// committed in batches. Like copy_message() deleted messages and messages
+// above the size limit are skipped.
+//
+// Messages that aren't in "files", e.g. those without Message-ID, are
+// added to "elsewhere" instead.
+//
+// Returns the number of copied messages
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  const char* arrow = direction == a_to_b ? "->" : "<-";
+  unsigned long copied = 0;
+  vector<MsgId> batch;
+  for ( ; ! list.done(); list.next()) {
+    MsgId msgid = list.key();
+    map<string, string>::const_iterator file = files.find( msgid );
+    if ( file == files.end() ) {
+      elsewhere[ msgid_table.intern( msgid ) ] = list.msgno();
+      continue;
+    }
+    const char* lead = "copied";
+    struct stat st;
+    if ( stat( file->second.c_str(), &st ) != 0 )
+      lead = "copyfail";
+    else if ( maildir_info( file->second ).find( 'T' ) != string::npos
+              && ! options.copy_deleted_messages )
+      lead = "ign. del";
+    else if ( channel.sizelimit
+              && (unsigned long) st.st_size > channel.sizelimit )
+      lead = "too big";
+    else if (! options.simulate && ! writer.add_file( file->second ) )
+      lead = "copyfail";
+
+    if ( options.show_from ) {
+      print_lead( lead, arrow );
+      print_msgid( msgid.printable().c_str() );
+      printf( "\n" );
+    }
+    if ( strcmp( lead, "copied" ) == 0 )
+      batch.push_back( msgid );
+    else
+      failed.push_back( msgid );
+
+    if ( writer.batch_full() ) {
+      if ( writer.commit() )
+        copied += batch.size();
+      else
+        failed.insert( failed.end(), batch.begin(), batch.end() );
+      batch.clear();
+    }
+  }
+  if ( writer.commit() )
+    copied += batch.size();
+  else
+    failed.insert( failed.end(), batch.begin(), batch.end() );
+  return copied;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool copy_maildir_files( Channel& channel, const MailboxPlan& sync,
+                                enum direction_t direction,
+                                vector<MsgId>& failed, unsigned long& copied)
+//
+// If the mailbox of "sync" is a local maildir in both stores copy the
+// messages as files - hard linked where possible - without c-client.
+// The files are found by the Message-ID headers, so that's only done for
+// HEADER_MSGID. Messages without one are copied by c-client.
+//
+// Returns false if that's not the case
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  string from, to;
+  map<string, string> files;
+  if ( options.msgid_type != HEADER_MSGID
+      || ! local_maildirs( channel, sync.mailbox, direction, from, to )
+      || ! maildir_files( from, files ) )
+    return false;
+
+  MaildirWriter writer( to );
+  MsgIdPositions elsewhere;
+  if ( sync.out_of_core ) {
+    SpilledIds::Cursor list( direction == a_to_b
+                             ? sync.spilled_result->copy_a_b
+                             : sync.spilled_result->copy_b_a );
+    copied = copy_files( channel, files, writer, direction, list, failed,
+                         elsewhere );
+  } else {
+    PositionedIds list( direction == a_to_b ? sync.copy_a_b
+                                            : sync.copy_b_a );
+    copied = copy_files( channel, files, writer, direction, list, failed,
+                         elsewhere );
+  }
+
+  if ( elsewhere.empty() )
+    ;
+  else if (! channel.open_for_copying( sync.mailbox, direction ) ) {
+    for ( MsgIdPositions::iterator i = elsewhere.begin();
+          i != elsewhere.end(); i++ )
+      failed.push_back( msgid_table.msgid( i->first ) );
+  }
+  else {
+    PositionedIds list( elsewhere );
+    copied += copy_messages( channel, sync.mailbox, direction, list, failed );
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class List>
+static unsigned long flag_messages_for_removal( Store& store, List& list,
+                                                char* place)
+//
+// Returns the number of messages flagged
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long removed = 0;
+  for ( ; ! list.done(); list.next())
+    if ( store.flag_message_for_removal( list.msgno(), list.key(), place) )
+      removed++;
+  return removed;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void print_mailbox_header( const string& mailbox )
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (options.show_from)
+    printf("\n *** %s ***\n", mailbox.c_str());
+  if (options.show_summary) {
+    printf("%s: ", mailbox.c_str());
+    fflush(stdout);
+  }
+  else {
+    printf("\n");
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// MailboxPlan
+//
+//////////////////////////////////////////////////////////////////////////
+MailboxPlan::~MailboxPlan()
+{
+  delete spilled_result;
+  delete duplicates_a;
+  delete duplicates_b;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+unsigned long MailboxPlan::copies( enum direction_t direction) const
+//
+// Number of messages to copy in "direction"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( out_of_core )
+    return direction == a_to_b ? spilled_result->copy_a_b.size()
+                               : spilled_result->copy_b_a.size();
+  return direction == a_to_b ? copy_a_b.size() : copy_b_a.size();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+unsigned long MailboxPlan::removals_a() const
+//
+// Number of messages to remove from store_a, including duplicates
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( out_of_core )
+    return spilled_result->remove_a.size() + duplicates_a->size();
+  return remove_a.size();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+unsigned long MailboxPlan::removals_b() const
+//
+// Same for store_b
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( out_of_core )
+    return spilled_result->remove_b.size() + duplicates_b->size();
+  return remove_b.size();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// SyncPlan
+//
+//////////////////////////////////////////////////////////////////////////
+SyncPlan::~SyncPlan()
+{
+  for (unsigned n = 0; n < mailboxes.size(); n++)
+    delete mailboxes[n];
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void SyncPlan::find_moves()
+//
+// Turn copies into moves within the target store where possible. Only
+// mailboxes that were classified in core take part.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for (unsigned n = 0; n < mailboxes.size(); n++) {
+    MailboxPlan& box = *mailboxes[n];
+    if ( box.out_of_core )
+      continue;
+    match_moves( box.mailbox, box.copy_b_a, leaving_a, box.move_a );
+    match_moves( box.mailbox, box.copy_a_b, leaving_b, box.move_b );
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool is_moved( const MovesPerMailbox& moves, MsgIdHandle msgid)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for ( MovesPerMailbox::const_iterator from = moves.begin();
+        from != moves.end(); from++ )
+    if ( from->second.count( msgid ) )
+      return true;
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static void count_copies( const MsgIdPositions& copy,
+                          const MovesPerMailbox& moves,
+                          const MsgIdSizes& sizes,
+                          unsigned long& copies, unsigned long long& bytes)
+//
+// Add the messages of "copy" that aren't moved instead and their sizes
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for ( MsgIdPositions::const_iterator i = copy.begin(); i != copy.end(); i++)
+  {
+    if ( is_moved( moves, i->first ) )
+      continue;
+    MsgIdSizes::const_iterator size = sizes.find( i->first );
+    copies++;
+    if ( size != sizes.end() )
+      bytes += size->second;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void SyncPlan::totals( const Channel& channel, PlanTotals& t) const
+//
+// Add up what carrying out the plan costs. The round trips are an
+// estimate of the commands sent to remote stores:
+//
+// + one per mailbox created
+// + one per copied message to fetch it and one to append it
+// + per pair of mailboxes messages are moved between: selecting the
+//   source, one per message to check its message-id and the copy
+// + selecting each mailbox for copying, once per direction
+// + when removing messages: selecting each mailbox, one per message to
+//   check its message-id, one to flag it and one to expunge the mailbox
+//
+// Local stores don't take round trips.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long ra = channel.store_a.isremote ? 1 : 0;
+  unsigned long rb = channel.store_b.isremote ? 1 : 0;
+  bool removing = options.delete_messages;   // also when simulating
+
+  t.creates = create_a.size() + create_b.size();
+  t.round_trips += create_a.size() * ra + create_b.size() * rb;
+
+  for (unsigned n = 0; n < mailboxes.size(); n++) {
+    const MailboxPlan& box = *mailboxes[n];
+    unsigned long copies_a_b = 0, copies_b_a = 0, flags_a = 0, flags_b = 0;
+
+    if ( box.out_of_core ) {
+      copies_a_b = box.copies( a_to_b );
+      copies_b_a = box.copies( b_to_a );
+      t.bytes_a_b += box.spilled_bytes_a_b;
+      t.bytes_b_a += box.spilled_bytes_b_a;
+    }
+    else {
+      count_copies( box.copy_a_b, box.move_b, box.sizes,
+                    copies_a_b, t.bytes_a_b );
+      count_copies( box.copy_b_a, box.move_a, box.sizes,
+                    copies_b_a, t.bytes_b_a );
+    }
+    flags_a = box.removals_a();
+    flags_b = box.removals_b();
+    t.copies_a_b += copies_a_b;
+    t.copies_b_a += copies_b_a;
+    t.round_trips += copies_a_b * (ra + rb) + copies_b_a * (ra + rb)
+                   + ra + rb;
+
+    for ( MovesPerMailbox::const_iterator from = box.move_a.begin();
+          from != box.move_a.end(); from++ ) {
+      t.moves += from->second.size();
+      t.round_trips += (from->second.size() + 2) * ra;
+    }
+    for ( MovesPerMailbox::const_iterator from = box.move_b.begin();
+          from != box.move_b.end(); from++ ) {
+      t.moves += from->second.size();
+      t.round_trips += (from->second.size() + 2) * rb;
+    }
+
+    if ( removing ) {
+      t.flags += flags_a + flags_b;
+      t.expunges += 2;
+      t.round_trips += (2 * flags_a + 2) * ra + (2 * flags_b + 2) * rb;
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void SyncPlan::print_totals( const Channel& channel, FILE* f) const
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  PlanTotals t;
+  totals( channel, t );
+
+  fprintf( f, "Plan for channel %s:\n", channel.name.c_str() );
+  fprintf( f, "  %lu mailbox%s to create\n",
+           t.creates, t.creates == 1 ? "" : "es" );
+  fprintf( f, "  %lu message%s (%llu bytes) to copy %s->%s\n",
+           t.copies_a_b, t.copies_a_b == 1 ? "" : "s", t.bytes_a_b,
+           channel.store_a.name.c_str(), channel.store_b.name.c_str() );
+  fprintf( f, "  %lu message%s (%llu bytes) to copy %s->%s\n",
+           t.copies_b_a, t.copies_b_a == 1 ? "" : "s", t.bytes_b_a,
+           channel.store_b.name.c_str(), channel.store_a.name.c_str() );
+  fprintf( f, "  %lu message%s to move between mailboxes\n",
+           t.moves, t.moves == 1 ? "" : "s" );
+  fprintf( f, "  %lu message%s to flag for removal, %lu expunge%s\n",
+           t.flags, t.flags == 1 ? "" : "s",
+           t.expunges, t.expunges == 1 ? "" : "s" );
+  fprintf( f, "  about %lu round trip%s\n",
+           t.round_trips, t.round_trips == 1 ? "" : "s" );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool execute_plan( Channel& channel, SyncPlan& plan,
+                   MsgIdsPerMailbox& thistime,
+                   SpilledIdsPerMailbox& spilled_thistime,
+                   MailboxMap& empty_mailboxes,
+                   MailboxMap& deleted_mailboxes)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Store& store_a = channel.store_a;
+  Store& store_b = channel.store_b;
+  bool& debug = options.debug;
+
+  ///////////////////////// creating mailboxes ////////////////////////////
+
+  // if a mailbox doesn't exist in one of the stores it's created there.
+  // Mailboxes that couldn't be created aren't synced. They're left out of
+  // msinfo as well - else the messages that weren't copied would look as
+  // if they were deleted from the new mailbox next time
+  set<string> not_created;
+  vector<string> created;
+  for (unsigned n = 0; n < plan.create_a.size(); n++)
+    if ( store_a.mailbox_create( plan.create_a[n] ) )
+      created.push_back( plan.create_a[n] );
+    else
+      not_created.insert( plan.create_a[n] );
+  plan.create_a.swap( created );
+  created.clear();
+  for (unsigned n = 0; n < plan.create_b.size(); n++)
+    if ( store_b.mailbox_create( plan.create_b[n] ) )
+      created.push_back( plan.create_b[n] );
+    else
+      not_created.insert( plan.create_b[n] );
+  plan.create_b.swap( created );
+
+  for ( set<string>::const_iterator box = not_created.begin();
+        box != not_created.end(); box++ ) {
+    thistime.erase( *box );
+    SpilledIdsPerMailbox::iterator spilled = spilled_thistime.find( *box );
+    if ( spilled != spilled_thistime.end() ) {
+      delete spilled->second;
+      spilled_thistime.erase( spilled );
+    }
+  }
+
+  ///////////////////////// moving messages ////////////////////////////
+
+  // Messages that were moved from one mailbox to another in one store are
+  // moved within the other store as well, instead of being copied over.
+  // This has to be done before any of the mailboxes is expunged.
+  for ( unsigned n = 0; n < plan.mailboxes.size(); n++ ) {
+    MailboxPlan& sync = *plan.mailboxes[n];
+    if ( ( sync.move_a.empty() && sync.move_b.empty() )
+         || not_created.count( sync.mailbox ) )
+      continue;
+
+    if (debug) printf( " Moving messages into \"%s\"\n", sync.mailbox.c_str());
+    unsigned long moved_a = move_messages( store_a, sync.mailbox,
+                                           sync.move_a, sync.copy_b_a );
+    unsigned long moved_b = move_messages( store_b, sync.mailbox,
+                                           sync.move_b, sync.copy_a_b );
+    if (moved_a) printf( "%s: %lu moved within %s.\n", sync.mailbox.c_str(),
+                         moved_a, store_a.name.c_str() );
+    if (moved_b) printf( "%s: %lu moved within %s.\n", sync.mailbox.c_str(),
+                         moved_b, store_b.name.c_str() );
+  }
+
+  ////////////////////////// syncing mailboxes ///////////////////////////
+
+  for ( unsigned n = 0; n < plan.mailboxes.size(); n++ ) {
+    MailboxPlan& sync = *plan.mailboxes[n];
+    unsigned long removed_a = 0, removed_b = 0, copied_a_b = 0,
+                  copied_b_a = 0;
+    // if we've failed to copy a message over we'll pretend that we
+    // haven't seen it at all. That way mailsync will have to rediscover
+    // and resync the same message again next time
+    vector<MsgId> failed;
+
+    if ( not_created.count( sync.mailbox ) )
+      continue;
+
+    print_mailbox_header( sync.mailbox );
+
+    //////////////////// copying messages ///////////////////////
+    
+    if (debug)
+      printf( " Copying messages from store \"%s\" to store \"%s\"\n",
+              store_a.name.c_str(), store_b.name.c_str() );
+
+    if (! sync.copies( a_to_b ))
+      ;                                 // don't open the mailboxes in vain
+    else if ( copy_maildir_files( channel, sync, a_to_b, failed, copied_a_b ) )
+      ;                                 // copied as files
+    else if (! channel.open_for_copying( sync.mailbox, a_to_b) )
+      return false;
+    else if ( sync.out_of_core ) {
+      SpilledIds::Cursor copy_a_b( sync.spilled_result->copy_a_b );
+      copied_a_b = sync.initial
+                   ? bulk_copy_messages( channel, sync.mailbox, a_to_b,
+                                         sync.scanned_a, copy_a_b, failed )
+                   : copy_messages( channel, sync.mailbox, a_to_b,
+                                    copy_a_b, failed );
+    } else {
+      PositionedIds copy_a_b( sync.copy_a_b );
+      copied_a_b = sync.initial
+                   ? bulk_copy_messages( channel, sync.mailbox, a_to_b,
+                                         sync.scanned_a, copy_a_b, failed )
+                   : copy_messages( channel, sync.mailbox, a_to_b,
+                                    copy_a_b, failed );
+    }
+
+    if (debug)
+      printf( " Copying messages from store \"%s\" to store \"%s\"\n",
+              store_b.name.c_str(), store_a.name.c_str() );
+
+    if (! sync.copies( b_to_a ))
+      ;
+    else if ( copy_maildir_files( channel, sync, b_to_a, failed, copied_b_a ) )
+      ;
+    else if (! channel.open_for_copying( sync.mailbox, b_to_a) )
+      return false;
+    else if ( sync.out_of_core ) {
+      SpilledIds::Cursor copy_b_a( sync.spilled_result->copy_b_a );
+      copied_b_a = sync.initial
+                   ? bulk_copy_messages( channel, sync.mailbox, b_to_a,
+                                         sync.scanned_b, copy_b_a, failed )
+                   : copy_messages( channel, sync.mailbox, b_to_a,
+                                    copy_b_a, failed );
+    } else {
+      PositionedIds copy_b_a( sync.copy_b_a );
+      copied_b_a = sync.initial
+                   ? bulk_copy_messages( channel, sync.mailbox, b_to_a,
+                                         sync.scanned_b, copy_b_a, failed )
+                   : copy_messages( channel, sync.mailbox, b_to_a,
+                                    copy_b_a, failed );
+    }
+
+    if ( sync.out_of_core ) {
+      if (! spilled_thistime[sync.mailbox]->erase(
+                                   set<string>( failed.begin(), failed.end() )))
+        return false;
+    } else {
+      MsgIdSet& msgids_now = thistime[sync.mailbox];
+      for ( vector<MsgId>::iterator i = failed.begin();
+            i != failed.end(); i++ ) {
+        MsgIdHandle handle;
+        if ( msgid_table.find( *i, handle ) )
+          msgids_now.erase( handle );
+      }
+    }
+    
+    printf("\n");
+    if (copied_a_b) printf( "%lu copied %s->%s.\n", copied_a_b,
+                            store_a.name.c_str(), store_b.name.c_str() );
+    if (copied_b_a) printf( "%lu copied %s->%s.\n", copied_b_a,
+                            store_b.name.c_str(), store_a.name.c_str() );
+    if (removed_a)  printf( "%lu deleted on %s.\n",
+                            removed_a, store_a.name.c_str() );
+    if (removed_b)  printf( "%lu deleted on %s.\n",
+                            removed_b, store_b.name.c_str() );
+    if (options.show_summary) {
+      printf( "%lu remain%s.\n", sync.now_n, sync.now_n != 1 ? "" : "s");
+      fflush(stdout);
+    } else {
+      printf( "%lu messages remain in %s\n",
+              sync.now_n, sync.mailbox.c_str() );
+    }
+
+    //////////////////// removing messages ///////////////////////
+
+    // a mirror's source is left alone, and the mirror is only opened when
+    // there's something to remove
+    bool on_a = ! options.mirror;
+    bool on_b = ! options.mirror || sync.removals_b();
+
+    if ( options.delete_messages && (! options.simulate) ) {
+    
+      if (debug && on_a) printf( " Removing messages from store \"%s\"\n",
+                                 store_a.name.c_str() );
+
+      // TODO: check first if there are any messages to be removed before
+      //       opening
+      if (! on_a)
+        ;
+      else if (! (store_a.stream = store_a.mailbox_open( sync.mailbox, 0 )))
+      {
+        store_a.print_error( "opening for removal ", sync.mailbox);
+      }
+      else if ( sync.out_of_core ) {
+        SpilledIds::Cursor remove( sync.spilled_result->remove_a );
+        SpilledIds::Cursor duplicates( *sync.duplicates_a );
+        removed_a = flag_messages_for_removal( store_a, remove, "< " )
+                  + flag_messages_for_removal( store_a, duplicates, "< " );
+      }
+      else {
+        PositionedIds remove( sync.remove_a );
+        removed_a = flag_messages_for_removal( store_a, remove, "< " );
+      }
+  
+      if (debug && on_b) printf( " Removing messages from store \"%s\"\n",
+                                 store_b.name.c_str() );
+
+      // TODO: check first if there are any messages to be removed before
+      //       opening
+      if (! on_b)
+        ;
+      else if (! (store_b.stream = store_b.mailbox_open( sync.mailbox, 0 )))
+      {
+        store_a.print_error( "opening for removal ", sync.mailbox);
+      }
+      else if ( sync.out_of_core ) {
+        SpilledIds::Cursor remove( sync.spilled_result->remove_b );
+        SpilledIds::Cursor duplicates( *sync.duplicates_b );
+        removed_b = flag_messages_for_removal( store_b, remove, "> " )
+                  + flag_messages_for_removal( store_b, duplicates, "> " );
+      }
+      else {
+        PositionedIds remove( sync.remove_b );
+        removed_b = flag_messages_for_removal( store_b, remove, "> " );
+      }
+
+      //////////////////////// expunging emails /////////////////////////
+      // this *needs* to be done *after* coying as the *last* step
+      // otherwise the order of the mails will get messed up since
+      // some random messages inbewteen have been deleted in the mean
+      // time and the message numbers we know don't correspond to
+      // messages in the mailbox/store any more
+    
+      if (debug) printf( " Expunging messages\n" );
+
+      int n_expunged_a = on_a ? store_a.mailbox_expunge( sync.mailbox ) : 0;
+      int n_expunged_b = on_b ? store_b.mailbox_expunge( sync.mailbox ) : 0;
+      if (n_expunged_a) printf( "Expunged %d mail%s in store %s\n"
+                              , n_expunged_a
+                              , n_expunged_a == 1 ? "" : "s"
+                              , store_a.name.c_str() );
+      if (n_expunged_b) printf( "Expunged %d mail%s in store %s\n"
+                              , n_expunged_b
+                              , n_expunged_b == 1 ? "" : "s"
+                              , store_b.name.c_str() );
+    }
+
+    //////////////////////// deleting empty mailboxes /////////////////////////
+    
+    if (options.delete_empty_mailboxes) {
+      if (sync.now_n == 0) {
+        // add empty mailbox to empty_mailboxes
+        empty_mailboxes[ sync.mailbox ];
+        deleted_mailboxes[ sync.mailbox ];
+      }
+    }
+
+    // close local boxes
+    if (!store_a.isremote)
+      store_a.stream = mail_close(store_a.stream);
+    if (store_b.stream && !store_b.isremote)
+      store_b.stream = mail_close(store_b.stream);
+
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Plan files
+//
+// A plan file is a text file with one item per line:
+//
+//  mailsync-plan 1
+//  channel <channel>
+//  create a|b <mailbox>               mailbox to create
+//  mailbox <mailbox>                  the following is done to <mailbox>
+//  remain <n>                         messages remaining afterwards
+//  initial                            first sync onto an empty mailbox
+//  store a|b <uidvalidity>            the following messages are in
+//                                     <mailbox> of store a respectively b
+//  copy <uid> <message-id>            copy to the other store
+//  remove <uid> <message-id>          flag for removal
+//  from a|b <uidvalidity> <mailbox>   the following messages are in
+//                                     another <mailbox> of the store
+//  move <uid> <message-id>            move to <mailbox> within the store
+//
+// Message ids are written as MsgId::printable() gives them, hash ids in
+// hex.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#define PLAN_FILE_VERSION "mailsync-plan 1"
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class List>
+static void write_plan_entries( FILE* f, MAILSTREAM* stream, const char* what,
+                                List& list, const MovesPerMailbox* moves)
+//
+// Write the messages in "list" with their UIDs, leaving out those in
+// "moves"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  for ( ; ! list.done(); list.next()) {
+    MsgId msgid = list.key();
+    MsgIdHandle handle;
+    if ( moves && msgid_table.find( msgid, handle )
+         && is_moved( *moves, handle ) )
+      continue;
+    fprintf( f, "%s %lu %s\n", what, mail_uid( stream, list.msgno() ),
+             msgid.printable().c_str() );
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool open_for_plan( Store& store, const string& mailbox)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  store.stream = store.mailbox_open( mailbox, OP_READONLY );
+  if (! store.stream)
+    store.print_error( "looking up UIDs in", mailbox );
+  return store.stream != NIL;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool write_plan( Channel& channel, const SyncPlan& plan, const char* file)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Store& store_a = channel.store_a;
+  Store& store_b = channel.store_b;
+
+  FILE* f = fopen( file, "w" );
+  if (! f) {
+    fprintf( stderr, "Error: Can't write plan file %s: %s\n",
+                     file, strerror(errno) );
+    return false;
+  }
+  fprintf( f, "%s\n", PLAN_FILE_VERSION );
+  fprintf( f, "channel %s\n", channel.name.c_str() );
+  for (unsigned n = 0; n < plan.create_a.size(); n++)
+    fprintf( f, "create a %s\n", plan.create_a[n].c_str() );
+  for (unsigned n = 0; n < plan.create_b.size(); n++)
+    fprintf( f, "create b %s\n", plan.create_b[n].c_str() );
+
+  for (unsigned n = 0; n < plan.mailboxes.size(); n++) {
+    const MailboxPlan& box = *plan.mailboxes[n];
+    bool created_a = find( plan.create_a.begin(), plan.create_a.end(),
+                           box.mailbox ) != plan.create_a.end();
+    bool created_b = find( plan.create_b.begin(), plan.create_b.end(),
+                           box.mailbox ) != plan.create_b.end();
+
+    fprintf( f, "mailbox %s\n", box.mailbox.c_str() );
+    fprintf( f, "remain %lu\n", box.now_n );
+    if ( box.initial )
+      fprintf( f, "initial\n" );
+
+    // a mailbox that is yet to be created has nothing to copy or remove
+    if (! created_a && open_for_plan( store_a, box.mailbox )) {
+      fprintf( f, "store a %lu\n", store_a.stream->uid_validity );
+      if ( box.out_of_core ) {
+        SpilledIds::Cursor copy( box.spilled_result->copy_a_b );
+        SpilledIds::Cursor remove( box.spilled_result->remove_a );
+        SpilledIds::Cursor duplicates( *box.duplicates_a );
+        write_plan_entries( f, store_a.stream, "copy", copy, NULL );
+        write_plan_entries( f, store_a.stream, "remove", remove, NULL );
+        write_plan_entries( f, store_a.stream, "remove", duplicates, NULL );
+      }
+      else {
+        PositionedIds copy( box.copy_a_b ), remove( box.remove_a );
+        write_plan_entries( f, store_a.stream, "copy", copy, &box.move_b );
+        write_plan_entries( f, store_a.stream, "remove", remove, NULL );
+      }
+    }
+    if (! created_b && open_for_plan( store_b, box.mailbox )) {
+      fprintf( f, "store b %lu\n", store_b.stream->uid_validity );
+      if ( box.out_of_core ) {
+        SpilledIds::Cursor copy( box.spilled_result->copy_b_a );
+        SpilledIds::Cursor remove( box.spilled_result->remove_b );
+        SpilledIds::Cursor duplicates( *box.duplicates_b );
+        write_plan_entries( f, store_b.stream, "copy", copy, NULL );
+        write_plan_entries( f, store_b.stream, "remove", remove, NULL );
+        write_plan_entries( f, store_b.stream, "remove", duplicates, NULL );
+      }
+      else {
+        PositionedIds copy( box.copy_b_a ), remove( box.remove_b );
+        write_plan_entries( f, store_b.stream, "copy", copy, &box.move_a );
+        write_plan_entries( f, store_b.stream, "remove", remove, NULL );
+      }
+    }
+
+    for ( MovesPerMailbox::const_iterator from = box.move_a.begin();
+          from != box.move_a.end(); from++ )
+      if ( open_for_plan( store_a, from->first ) ) {
+        fprintf( f, "from a %lu %s\n", store_a.stream->uid_validity,
+                 from->first.c_str() );
+        PositionedIds move( from->second );
+        write_plan_entries( f, store_a.stream, "move", move, NULL );
+      }
+    for ( MovesPerMailbox::const_iterator from = box.move_b.begin();
+          from != box.move_b.end(); from++ )
+      if ( open_for_plan( store_b, from->first ) ) {
+        fprintf( f, "from b %lu %s\n", store_b.stream->uid_validity,
+                 from->first.c_str() );
+        PositionedIds move( from->second );
+        write_plan_entries( f, store_b.stream, "move", move, NULL );
+      }
+
+    if (store_a.stream && !store_a.isremote)
+      store_a.stream = mail_close(store_a.stream);
+    if (store_b.stream && !store_b.isremote)
+      store_b.stream = mail_close(store_b.stream);
+  }
+
+  if ( fclose( f ) != 0 ) {
+    fprintf( stderr, "Error: Can't write plan file %s: %s\n",
+                     file, strerror(errno) );
+    return false;
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool read_line( FILE* f, string& line)
+//
+// Read a line of any length without its newline
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  char buf[1024];
+  line.erase();
+  while ( fgets( buf, sizeof(buf), f ) ) {
+    size_t len = strlen( buf );
+    if ( len && buf[len-1] == '\n' ) {
+      line.append( buf, len-1 );
+      return true;
+    }
+    line.append( buf, len );
+  }
+  return ! line.empty();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+static bool find_planned_message( MAILSTREAM* stream, const string& entry,
+                                  MsgIdHandle& msgid, unsigned long& msgno)
+//
+// Find the message of a "<uid> <message-id>" plan entry in "stream"
+//
+// Returns false if it isn't there anymore or its message-id doesn't match
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  char* end;
+  unsigned long uid = strtoul( entry.c_str(), &end, 10 );
+  if ( *end != ' ' )
+    return false;
+  MsgId expected = MsgId::from_printable( end + 1 );
+  msgno = uid ? mail_msgno( stream, uid ) : 0;
+  if (! msgno) {
+    if (options.debug)
+      printf( " Planned message %s is gone\n", expected.printable().c_str() );
+    return false;
+  }
+  ENVELOPE* envelope = mail_fetchenvelope( stream, msgno );
+  if (! envelope || MsgId( stream, msgno, envelope ) != expected) {
+    printf( "Warning: message-id of UID %lu in %s doesn't match %s,"
+            " skipping it\n", uid, stream->mailbox,
+            expected.printable().c_str() );
+    return false;
+  }
+  msgid = msgid_table.intern( expected );
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool read_plan( Channel& channel, SyncPlan& plan, const char* file)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  FILE* f = fopen( file, "r" );
+  if (! f) {
+    fprintf( stderr, "Error: Can't read plan file %s: %s\n",
+                     file, strerror(errno) );
+    return false;
+  }
+
+  string line;
+  if (! read_line( f, line ) || line != PLAN_FILE_VERSION) {
+    fprintf( stderr, "Error: %s is not a mailsync plan file\n", file );
+    fclose( f );
+    return false;
+  }
+
+  MailboxPlan* box = NULL;
+  Store* store = NULL;                  // store of the following messages
+  MsgIdPositions* copy = NULL;          // where they go in "box"
+  MsgIdPositions* remove = NULL;
+  MsgIdPositions* move = NULL;
+  bool valid = false;                   // UIDVALIDITY matches
+  unsigned long lineno = 1;
+
+  while ( read_line( f, line ) ) {
+    lineno++;
+    string::size_type space = line.find( ' ' );
+    string item = line.substr( 0, space );
+    string rest = space == string::npos ? string() : line.substr( space+1 );
+    char side = rest.empty() ? 0 : rest[0];
+    string args = rest.length() > 2 ? rest.substr( 2 ) : string();
+    MsgIdHandle msgid;
+    unsigned long msgno;
+
+    if ( item == "channel" ) {
+      if ( rest != channel.name ) {
+        fprintf( stderr, "Error: %s is a plan for channel %s, not %s\n",
+                         file, rest.c_str(), channel.name.c_str() );
+        fclose( f );
+        return false;
+      }
+    }
+    else if ( item == "create" && (side == 'a' || side == 'b') )
+      (side == 'a' ? plan.create_a : plan.create_b).push_back( args );
+    else if ( item == "mailbox" ) {
+      box = new MailboxPlan( rest );
+      plan.mailboxes.push_back( box );
+      copy = remove = move = NULL;
+      valid = false;
+    }
+    else if ( item == "remain" && box )
+      box->now_n = strtoul( rest.c_str(), NULL, 10 );
+    else if ( item == "initial" && box )
+      box->initial = true;
+    else if ( (item == "store" || item == "from") && box
+              && (side == 'a' || side == 'b') ) {
+      store = side == 'a' ? &channel.store_a : &channel.store_b;
+      char* end;
+      unsigned long uid_validity = strtoul( args.c_str(), &end, 10 );
+      string mailbox = item == "store" ? box->mailbox
+                                       : string( *end ? end + 1 : end );
+      copy = remove = move = NULL;
+      if ( item == "store" ) {
+        copy   = side == 'a' ? &box->copy_a_b : &box->copy_b_a;
+        remove = side == 'a' ? &box->remove_a : &box->remove_b;
+      }
+      else
+        move = &(side == 'a' ? box->move_a : box->move_b)[ mailbox ];
+      store->stream = store->mailbox_open( mailbox, OP_READONLY );
+      valid = store->stream && store->stream->uid_validity == uid_validity;
+      if (! store->stream)
+        store->print_error( "looking up UIDs in", mailbox );
+      else if (! valid)
+        printf( "Warning: UIDVALIDITY of %s in %s has changed,"
+                " skipping its planned messages\n",
+                mailbox.c_str(), store->name.c_str() );
+      else if ( item == "store" )
+        (side == 'a' ? box->scanned_a : box->scanned_b).take( store->stream );
+    }
+    else if ( item == "copy" || item == "remove" || item == "move" ) {
+      MsgIdPositions* list = item == "copy"   ? copy
+                           : item == "remove" ? remove : move;
+      if ( valid && list
+           && find_planned_message( store->stream, rest, msgid, msgno ) )
+        (*list)[ msgid ] = msgno;
+    }
+    else {
+      fprintf( stderr, "Error: can't understand line %lu of plan file %s\n",
+                       lineno, file );
+      fclose( f );
+      return false;
+    }
+  }
+  fclose( f );
+
+  Store& store_a = channel.store_a;
+  Store& store_b = channel.store_b;
+  if (store_a.stream && !store_a.isremote)
+    store_a.stream = mail_close(store_a.stream);
+  if (store_b.stream && !store_b.isremote)
+    store_b.stream = mail_close(store_b.stream);
+  return true;
+}
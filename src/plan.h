@@ -0,0 +1,183 @@
+#ifndef __MAILSYNC_PLAN__
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "types.h"
+#include "channel.h"
+#include "classify.h"
+#include "spill.h"
+
+using namespace std;
+
+// Messages of other mailboxes, keyed by the name of the mailbox they're in
+typedef map<string, MsgIdPositions> MovesPerMailbox;
+
+// Sizes of messages in bytes
+typedef map<MsgIdHandle, unsigned long> MsgIdSizes;
+
+// A message that is about to be removed from a mailbox
+struct Leaving
+{
+  string mailbox;
+  unsigned long msgno;
+};
+typedef map<MsgIdHandle, Leaving> LeavingIndex;
+
+//////////////////////////////////////////////////////////////////////////
+//
+struct ScanState
+//
+// What an open mailbox looked like when it was scanned. Its message
+// numbers are still the ones of the scan as long as it looks the same.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  bool known;
+  unsigned long nmsgs, uid_validity, uid_last;
+
+  ScanState(): known(false), nmsgs(0), uid_validity(0), uid_last(0) {}
+  void take( MAILSTREAM* stream)
+  {
+    known = true;
+    nmsgs = stream->nmsgs;
+    uid_validity = stream->uid_validity;
+    uid_last = stream->uid_last;
+  }
+  bool matches( MAILSTREAM* stream) const
+  {
+    return known && stream && stream->nmsgs == nmsgs
+           && stream->uid_validity == uid_validity
+           && stream->uid_last == uid_last;
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+struct MailboxPlan
+//
+// What is to be done to one mailbox
+//
+// In core the lists map the message ids to their message numbers in the
+// store they're copied from or removed in. Out of core the classification
+// and the duplicates are spilled.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  string mailbox;
+  bool out_of_core;
+  MsgIdPositions copy_a_b, copy_b_a, remove_a, remove_b;
+  MsgIdSizes sizes;                     // of the messages to copy
+  MovesPerMailbox move_a, move_b;       // moves within store_a / store_b
+                                        // into this mailbox
+  SpilledClassification* spilled_result;
+  SpilledIds* duplicates_a;
+  SpilledIds* duplicates_b;
+  unsigned long long spilled_bytes_a_b, spilled_bytes_b_a;
+  unsigned long now_n;                  // messages remaining afterwards
+  bool initial;                         // first sync onto an empty mailbox,
+                                        // copied in batches
+  ScanState scanned_a, scanned_b;       // of this mailbox in either store
+
+  MailboxPlan( const string& box):
+    mailbox(box), out_of_core(false), spilled_result(NULL),
+    duplicates_a(NULL), duplicates_b(NULL), spilled_bytes_a_b(0),
+    spilled_bytes_b_a(0), now_n(0), initial(false) {}
+  ~MailboxPlan();
+
+  unsigned long copies( enum direction_t direction) const;
+  unsigned long removals_a() const;
+  unsigned long removals_b() const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+struct PlanTotals
+//
+// What carrying out a plan costs
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long creates;
+  unsigned long copies_a_b, copies_b_a;
+  unsigned long long bytes_a_b, bytes_b_a;
+  unsigned long moves;
+  unsigned long flags;                  // messages flagged for removal
+  unsigned long expunges;
+  unsigned long round_trips;
+
+  PlanTotals(): creates(0), copies_a_b(0), copies_b_a(0), bytes_a_b(0),
+                bytes_b_a(0), moves(0), flags(0), expunges(0),
+                round_trips(0) {}
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+class SyncPlan
+//
+// Everything a sync of a channel is going to do. It's made up while
+// scanning the mailboxes, before anything is changed, and then carried
+// out by execute_plan().
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    vector<string> create_a, create_b;  // mailboxes to create, submailboxes
+                                        // first
+    vector<MailboxPlan*> mailboxes;
+    LeavingIndex leaving_a, leaving_b;  // messages about to be removed from
+                                        // a mailbox, channel wide
+
+    SyncPlan(): create_a(), create_b(), mailboxes(), leaving_a(),
+                leaving_b() {}
+    ~SyncPlan();
+
+    void find_moves();
+    void totals( const Channel& channel, PlanTotals& t) const;
+    void print_totals( const Channel& channel, FILE* f) const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool execute_plan( Channel& channel, SyncPlan& plan,
+                   MsgIdsPerMailbox& thistime,
+                   SpilledIdsPerMailbox& spilled_thistime,
+                   MailboxMap& empty_mailboxes,
+                   MailboxMap& deleted_mailboxes);
+//
+// Carry out "plan". Messages that couldn't be copied are taken out of
+// "thistime" respectively "spilled_thistime", so that they're
+// rediscovered next time, as are whole mailboxes that couldn't be
+// created. Those are taken out of plan.create_a and plan.create_b too.
+// Mailboxes that are left empty are added to "empty_mailboxes" and
+// "deleted_mailboxes" if they're to be deleted.
+//
+// Returns false if a mailbox couldn't be opened for copying
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool write_plan( Channel& channel, const SyncPlan& plan, const char* file);
+bool read_plan( Channel& channel, SyncPlan& plan, const char* file);
+//
+// Save "plan" to "file" respectively read it back, for --plan-out and
+// --plan-in. Messages are saved by their UIDs, together with the
+// UIDVALIDITY of their mailbox and their message-id. When the plan is
+// read back, messages whose mailbox has a different UIDVALIDITY by now,
+// that have gone or whose message-id doesn't match are left out.
+//
+// Both open the mailboxes of the plan. Return false if "file" can't be
+// written or read.
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+void print_mailbox_header( const string& mailbox );
+//
+//////////////////////////////////////////////////////////////////////////
+
+#define __MAILSYNC_PLAN__
+#endif
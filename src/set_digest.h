@@ -0,0 +1,60 @@
+#ifndef __MAILSYNC_SET_DIGEST__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "msgid_table.h"
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+class SetDigest
+//
+// Order independent digest of a set of message ids: their number and the
+// sum and xor of their hash_msgid()s. Ids can be added in any order, and
+// removed again, so the digest of a mailbox is computed while its
+// messages are scanned.
+//
+// Stored in msinfo as "<>, digest: <count> <sum> <xor>", see
+// Channel::write_thistime_seen()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    SetDigest(): count(0), sum(0), xor_all(0) {}
+
+    void add( uint64_t hash)    { count++; sum += hash; xor_all ^= hash; }
+    void remove( uint64_t hash) { count--; sum -= hash; xor_all ^= hash; }
+
+    bool operator==( const SetDigest& d) const
+    {
+      return count == d.count && sum == d.sum && xor_all == d.xor_all;
+    }
+    bool operator!=( const SetDigest& d) const { return ! (*this == d); }
+    unsigned long size() const { return count; }
+
+    string to_string() const
+    {
+      char buf[80];
+      sprintf( buf, "%lu %016llx %016llx", count,
+               (unsigned long long) sum, (unsigned long long) xor_all);
+      return buf;
+    }
+    bool from_string( const string& s)
+    {
+      unsigned long long s1, x1;
+      if (sscanf( s.c_str(), "%lu %llx %llx", &count, &s1, &x1) != 3)
+        return false;
+      sum = s1;
+      xor_all = x1;
+      return true;
+    }
+
+  private:
+    unsigned long count;
+    uint64_t sum, xor_all;
+};
+
+#define __MAILSYNC_SET_DIGEST__
+#endif
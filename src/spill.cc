@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>             // pread()
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include "spill.h"
+
+//////////////////////////////////////////////////////////////////////////
+//
+// All files consist of records of the form
+//
+// <message number, 8 bytes> <length of id, 4 bytes> <id>
+//
+// in host byte order - they never outlive the process.
+//
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+//
+// SpilledIds
+//
+//////////////////////////////////////////////////////////////////////////
+SpilledIds::SpilledIds( size_t chunk):
+  chunk_size(chunk), buffered(0), buffer(), runs(), run_levels(),
+  sorted(NULL), count(0), failed(false) {}
+
+SpilledIds::~SpilledIds()
+{
+  for (unsigned i = 0; i < runs.size(); i++)
+    fclose( runs[i]);
+  if (sorted)
+    fclose( sorted);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+FILE* SpilledIds::new_file()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  FILE* f = tmpfile();
+  if (! f) {
+    fprintf( stderr, "Error: Can't create tmp file for spilling message ids\n");
+    if (errno) perror( strerror(errno) );
+    failed = true;
+  }
+  return f;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void SpilledIds::write_record( FILE* f, const string& id, unsigned long msgno)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  uint64_t n = msgno;
+  uint32_t len = id.size();
+  if (fwrite( &n, sizeof(n), 1, f) != 1
+      || fwrite( &len, sizeof(len), 1, f) != 1
+      || (len && fwrite( id.data(), len, 1, f) != 1))
+  {
+    if (! failed)
+      fprintf( stderr, "Error: Can't write spilled message ids: %s\n",
+                       strerror(errno));
+    failed = true;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void SpilledIds::flush_run()
+//
+// Sort the buffered ids and write them to a new run file
+//
+// Runs stay open until finish(). So that a big mailbox with a small chunk
+// size doesn't run out of file descriptors, whenever the last
+// SPILL_MERGE_FAN_IN runs have been merged equally often they're merged
+// into one - like the digits of a counter. That keeps the number of runs
+// logarithmic in the number of ids, and each id gets merged only that
+// many times.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (buffer.empty())
+    return;
+  sort( buffer.begin(), buffer.end());
+  FILE* f = new_file();
+  if (f) {
+    for (unsigned long i = 0; i < buffer.size(); i++)
+      write_record( f, buffer[i].id, buffer[i].msgno);
+    fflush( f);
+    runs.push_back( f);
+    run_levels.push_back( 0);
+  }
+  vector<Record>().swap( buffer);       // actually release the memory
+  buffered = 0;
+
+  // the levels never increase towards the end
+  while (runs.size() >= SPILL_MERGE_FAN_IN
+         && run_levels[runs.size() - SPILL_MERGE_FAN_IN] == run_levels.back())
+  {
+    unsigned first = runs.size() - SPILL_MERGE_FAN_IN;
+    unsigned level = run_levels.back() + 1;
+    FILE* merged = new_file();
+    if (! merged)
+      return;
+    merge_runs( first, merged, false, NULL);
+    runs.push_back( merged);
+    run_levels.push_back( level);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void SpilledIds::add( const string& id, unsigned long msgno)
+//
+// Add an id in any order. finish() must be called before reading.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  Record r;
+  r.id = id;
+  r.msgno = msgno;
+  buffer.push_back( r);
+  buffered += sizeof(Record) + id.size();
+  if (buffered > chunk_size)
+    flush_run();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void SpilledIds::append( const string& id, unsigned long msgno)
+//
+// Append an id that sorts after all ids appended so far
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (! sorted)
+    sorted = new_file();
+  if (sorted)
+    write_record( sorted, id, msgno);
+  count++;
+}
+
+// Orders cursors on runs for the merge. Equal ids are ordered by run,
+// runs by position in the mailbox, so the first occurrence wins.
+struct later_run
+{
+  const vector<SpilledIds::Cursor*>& cursors;
+  later_run( const vector<SpilledIds::Cursor*>& c): cursors(c) {}
+  bool operator()( unsigned r1, unsigned r2) const
+  {
+    const string& k1 = cursors[r1]->key();
+    const string& k2 = cursors[r2]->key();
+    if (k1 == k2)
+      return r1 > r2;
+    return k2 < k1;
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+unsigned long SpilledIds::merge_runs( unsigned first, FILE* out, bool unique,
+                                      SpilledIds* duplicates)
+//
+// Merge the runs from the "first" one on into "out" and close them. With
+// "unique" only the first of several entries with the same id is written,
+// the others are appended to "duplicates" if given.
+//
+// Returns the number of entries written to "out"
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  vector<Cursor*> cursors;
+  for (unsigned i = first; i < runs.size(); i++)
+    cursors.push_back( new Cursor( runs[i]));
+
+  later_run order( cursors);
+  priority_queue< unsigned, vector<unsigned>, later_run > heads( order);
+  for (unsigned i = 0; i < cursors.size(); i++)
+    if (! cursors[i]->done())
+      heads.push( i);
+
+  unsigned long written = 0;
+  string last;
+  bool have_last = false;
+  while (! heads.empty()) {
+    unsigned r = heads.top();
+    heads.pop();
+    const string& id = cursors[r]->key();
+    if (unique && have_last && id == last) {
+      if (duplicates)
+        duplicates->append( id, cursors[r]->msgno());
+    }
+    else {
+      write_record( out, id, cursors[r]->msgno());
+      written++;
+      if (unique) {
+        last = id;
+        have_last = true;
+      }
+    }
+    cursors[r]->next();
+    if (! cursors[r]->done())
+      heads.push( r);
+  }
+
+  for (unsigned i = 0; i < cursors.size(); i++) {
+    delete cursors[i];
+    fclose( runs[first + i]);
+  }
+  runs.resize( first);
+  run_levels.resize( first);
+  fflush( out);
+  return written;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool SpilledIds::finish( SpilledIds* duplicates)
+//
+// Merge all run files into one sorted list. Of several entries with the
+// same id only the first is kept, the others are appended to "duplicates"
+// if given.
+//
+// Returns false if any file operation failed
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  flush_run();
+
+  // the runs at the end are the smaller ones, they're merged first
+  while (runs.size() > SPILL_MERGE_FAN_IN) {
+    unsigned first = runs.size() - SPILL_MERGE_FAN_IN;
+    unsigned level = run_levels[first] + 1;
+    FILE* merged = new_file();
+    if (! merged)
+      return false;
+    merge_runs( first, merged, false, NULL);
+    runs.push_back( merged);
+    run_levels.push_back( level);
+  }
+
+  if (! sorted)
+    sorted = new_file();
+  if (! sorted)
+    return false;
+  count += merge_runs( 0, sorted, true, duplicates);
+  return ! failed;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool SpilledIds::erase( const set<string>& ids)
+//
+// Remove "ids" from the sorted list
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if (ids.empty() || ! sorted)
+    return ! failed;
+
+  FILE* rest = new_file();
+  if (! rest)
+    return false;
+  count = 0;
+  for (Cursor c( *this); ! c.done(); c.next())
+    if (! ids.count( c.key())) {
+      write_record( rest, c.key(), c.msgno());
+      count++;
+    }
+  fclose( sorted);
+  sorted = rest;
+  fflush( sorted);
+  return ! failed;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// SpilledIds::Cursor
+//
+//////////////////////////////////////////////////////////////////////////
+SpilledIds::Cursor::Cursor( const SpilledIds& ids):
+  fd(-1), offset(0), buf(65536), buf_pos(0), buf_len(0), id(), no(0),
+  at_end(false)
+{
+  if (ids.sorted) {
+    fflush( ids.sorted);
+    fd = fileno( ids.sorted);
+  }
+  next();
+}
+
+SpilledIds::Cursor::Cursor( FILE* f):
+  fd(-1), offset(0), buf(65536), buf_pos(0), buf_len(0), id(), no(0),
+  at_end(false)
+{
+  if (f) {
+    fflush( f);
+    fd = fileno( f);
+  }
+  next();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool SpilledIds::Cursor::read( void* dst, size_t n)
+//
+// Buffered read using pread, so that the file offset shared by all
+// cursors on the same file isn't touched
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  char* d = (char*) dst;
+  while (n) {
+    if (buf_pos == buf_len) {
+      ssize_t r = pread( fd, &buf[0], buf.size(), offset);
+      if (r <= 0)
+        return false;
+      offset += r;
+      buf_pos = 0;
+      buf_len = r;
+    }
+    size_t chunk = min( n, buf_len - buf_pos);
+    memcpy( d, &buf[buf_pos], chunk);
+    buf_pos += chunk;
+    d += chunk;
+    n -= chunk;
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void SpilledIds::Cursor::next()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  uint64_t n;
+  uint32_t len;
+
+  if (fd < 0 || ! read( &n, sizeof(n)) || ! read( &len, sizeof(len))) {
+    at_end = true;
+    return;
+  }
+  id.resize( len);
+  if (len && ! read( &id[0], len)) {
+    at_end = true;
+    return;
+  }
+  no = n;
+}
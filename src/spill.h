@@ -0,0 +1,116 @@
+#ifndef __MAILSYNC_SPILL__
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Out of core message id lists
+//
+// When the message ids of a mailbox would exceed the memory budget given
+// with --max-memory, they are not interned but spilled to temporary run
+// files, sorted externally and classified with a merge over the files
+// (see classify_merge in classify.h).
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Rough memory cost of one message id while syncing a mailbox in memory:
+// the interned string, its hash slot and the tree nodes in the position
+// maps and the lasttime and result sets
+#define BYTES_PER_MSGID 200
+
+// Number of run files merged at once. Each run is an open file and each
+// run being merged gets a read buffer, so runs are merged in passes of at
+// most this many - see SpilledIds::flush_run
+#define SPILL_MERGE_FAN_IN 16
+
+//////////////////////////////////////////////////////////////////////////
+//
+class SpilledIds
+//
+// A list of message ids together with their message numbers, kept in
+// temporary files
+//
+// Ids are either add()ed in any order and then sorted by finish(), or
+// append()ed in sorted order. Cursors read the sorted list.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    SpilledIds( size_t chunk_size);
+    ~SpilledIds();
+
+    void add( const string& id, unsigned long msgno);
+    void append( const string& id, unsigned long msgno);
+    bool finish( SpilledIds* duplicates);
+    bool erase( const set<string>& ids);
+    unsigned long size() const { return count; }
+
+    //////////////////////////////////////////////////////////////////////
+    //
+    class Cursor
+    //
+    // Sequential reader of a sorted list, a Source for classify_merge.
+    // Cursors on the same list are independent of each other.
+    //
+    //////////////////////////////////////////////////////////////////////
+    {
+      public:
+        Cursor( const SpilledIds& ids);
+        Cursor( FILE* f);
+        bool done() const                { return at_end; }
+        const string& key() const        { return id; }
+        unsigned long msgno() const      { return no; }
+        void next();
+
+      private:
+        int fd;
+        off_t offset;                   // of the data in buf
+        vector<char> buf;
+        size_t buf_pos, buf_len;
+        string id;
+        unsigned long no;
+        bool at_end;
+
+        bool read( void* dst, size_t n);
+    };
+
+  private:
+    struct Record {
+      string id;
+      unsigned long msgno;
+      bool operator<( const Record& r) const
+      {
+        return id < r.id || (id == r.id && msgno < r.msgno);
+      }
+    };
+
+    size_t chunk_size, buffered;
+    vector<Record> buffer;
+    vector<FILE*> runs;
+    vector<unsigned> run_levels;        // how often the ids in each run have
+                                        // been merged
+    FILE* sorted;
+    unsigned long count;
+    bool failed;
+
+    SpilledIds( const SpilledIds&);
+    SpilledIds& operator=( const SpilledIds&);
+
+    FILE* new_file();
+    void write_record( FILE* f, const string& id, unsigned long msgno);
+    void flush_run();
+    unsigned long merge_runs( unsigned first, FILE* out, bool unique,
+                              SpilledIds* duplicates);
+};
+
+typedef map<string, SpilledIds*> SpilledIdsPerMailbox;
+
+#define __MAILSYNC_SPILL__
+#endif
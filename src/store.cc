@@ -1,11 +1,14 @@
+#include <string.h>
 #include "options.h"
 #include "utils.h"
 #include "store.h"
 #include "mail_handling.h"
+#include "msgid_policy.h"
 
 #include <iostream>     // only for debuging
 
 extern Store*        match_pattern_store;
+extern MAILSTATUS*   requested_status;
 extern Passwd*       current_context_passwd;
 extern enum operation_mode_t operation_mode;
 extern options_t options;
@@ -165,6 +168,31 @@ MAILSTREAM* Store::mailbox_open( const string& boxname,
   return this->stream;
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+bool Store::mailbox_status( const string& boxname, MAILSTATUS& status)
+//
+// Ask for the number of messages, UIDNEXT and UIDVALIDITY of "boxname",
+// over the open stream of the store - without one c-client would make a
+// new connection
+//
+// Returns false if they aren't known
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  const long wanted = SA_MESSAGES | SA_UIDNEXT | SA_UIDVALIDITY;
+  if (! this->stream)
+    return false;
+  string fullboxname = this->full_mailbox_name(boxname);
+  current_context_passwd = &passwd;
+
+  memset( &status, 0, sizeof(status));
+  requested_status = &status;
+  long ok = mail_status( this->stream, nccs( fullboxname), wanted);
+  requested_status = NULL;
+  return ok && (status.flags & wanted) == wanted;
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 bool Store::mailbox_create( const string& boxname )
@@ -201,18 +229,109 @@ bool Store::mailbox_create( const string& boxname )
 
 //////////////////////////////////////////////////////////////////////////
 //
-bool Store::fetch_message_ids(MsgIdPositions& mids, MsgIdSet& remove_set)
+bool Store::mailbox_rename( const string& from, const string& to )
+//
+// Renames the mailbox "from" to "to" in the store - on the server if it's
+// a remote store
+//
+// Returns false on failure.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  current_context_passwd = &passwd;
+  
+  if ( options.simulate ) { // just fail if simulating
+    printf( "Renaming %s to %s in %s\n", from.c_str(), to.c_str(),
+            this->name.c_str());
+    return false;
+  }
+  
+  bool res = mail_rename( this->stream,
+                          nccs( this->full_mailbox_name(from) ),
+                          nccs( this->full_mailbox_name(to) ) );
+  
+  if ( options.debug) {
+    if ( res )
+      printf( "Renamed %s to %s in %s\n", from.c_str(), to.c_str(),
+              this->name.c_str());
+    else
+      printf( "Failed to rename %s to %s in %s\n", from.c_str(), to.c_str(),
+              this->name.c_str());
+  }
+
+  return res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool Store::messages_copy( const string& sequence, const string& to )
+//
+// Copies the messages "sequence" of the currently open mailbox to the
+// mailbox "to" of the same store. For a remote store this is a single
+// COPY on the server - no message is transferred.
+//
+// Returns false on failure.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  current_context_passwd = &passwd;
+
+  if ( options.simulate ) {
+    printf( "Copying %s from %s to %s in %s\n", sequence.c_str(),
+            this->stream->mailbox, to.c_str(), this->name.c_str());
+    return true;
+  }
+
+  // the target is a mailbox on the same server, so it's named without
+  // the "{server}" part
+  string target = this->full_mailbox_name(to).substr( server.length() );
+  bool res = mail_copy_full( this->stream, nccs( sequence ), nccs( target ),
+                             0 );
+
+  if ( options.debug) {
+    if ( res )
+      printf( "Copied %s to %s in %s\n", sequence.c_str(), to.c_str(),
+              this->name.c_str());
+    else
+      printf( "Failed to copy %s to %s in %s\n", sequence.c_str(),
+              to.c_str(), this->name.c_str());
+  }
+
+  return res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool Store::fetch_message_ids(MsgIdPositions& mids, MsgIdSet& remove_set,
+                              SetDigest& digest, UidCache* uids)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  IDENTITY_DISPATCH( fetch_message_ids_as, ( mids, remove_set, digest, uids))
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class Identity>
+bool Store::fetch_message_ids_as(MsgIdPositions& mids, MsgIdSet& remove_set,
+                                 SetDigest& digest, UidCache* uids)
 //
 // Fetch all the message ids that the currently open mailbox contains.
 // 
 // If there are duplicates they will be added to the remove_set
 // (depending on the compile time option expunge_duplicates)
 //
+// If "uids" is given the message ids of the UIDs in it are taken from
+// there instead of being fetched. If it covers the mailbox, not even the
+// UIDs are fetched. Afterwards it holds the UIDs of all messages in
+// "mids".
+//
 // returns:
 //              0              - failure
 //              1              - success
 //              mids           - a hash indexed by msgid containing the
 //                               position of the message in the mailbox
+//              digest         - the digest of the message ids in mids
 //
 //////////////////////////////////////////////////////////////////////////
 {
@@ -225,37 +344,63 @@ bool Store::fetch_message_ids(MsgIdPositions& mids, MsgIdSet& remove_set)
             this->stream->mailbox);
   }
 
+  vector<MsgIdHandle> cached;
+  if ( uids && uids->covers( this->stream->uid_validity,
+                             this->stream->uid_last, n, cached ) ) {
+    for (unsigned long msgno=1; msgno<=n; msgno++) {
+      mids.insert(make_pair(cached[msgno-1], msgno));
+      digest.add( msgid_table.hash( cached[msgno-1] ));
+    }
+    if (options.debug)
+      printf( " All %lu message id's were known by their UIDs\n", n );
+    return 1;
+  }
+
+  UidCache uids_now;
+  unsigned long ncached = 0;
+  if ( uids )
+    uids_now.uidvalidity = uids->uidvalidity;
+
   for (unsigned long msgno=1; msgno<=n; msgno++) {
     MsgId msgid;
     ENVELOPE *envelope;
     bool isdup;
+    unsigned long uid = uids ? mail_uid( this->stream, msgno) : 0;
+    MsgIdHandle handle;
 
-    envelope = mail_fetchenvelope( this->stream, msgno);
-    if (! envelope) {
-      fprintf( stderr,
-               "Error: Couldn't fetch enveloppe #%lu from mailbox box %s\n",
-               msgno, this->stream->mailbox);
-      fprintf( stderr, "       Aborting!\n");
-      return 0;
+    if ( uids && uids->lookup( uid, handle) ) {
+      msgid = msgid_table.msgid( handle );
+      ncached++;
     }
-    msgid = MsgId(envelope);
-    if (msgid.length() == 0) {
-      print_lead("no msg-id", "");
-      nabsent++;
-      // Absent message-id.  Don't touch message.
-      continue;
+    else {
+      envelope = mail_fetchenvelope( this->stream, msgno);
+      if (! envelope) {
+        fprintf( stderr,
+                 "Error: Couldn't fetch enveloppe #%lu from mailbox box %s\n",
+                 msgno, this->stream->mailbox);
+        fprintf( stderr, "       Aborting!\n");
+        return 0;
+      }
+      msgid = Identity::from_message( this->stream, msgno, envelope);
+      if (msgid.length() == 0) {
+        print_lead("no msg-id", "");
+        nabsent++;
+        // Absent message-id.  Don't touch message.
+        continue;
+      }
+      handle = msgid_table.intern( msgid );
     }
-    isdup = mids.count( msgid );
+    isdup = mids.count( handle );
     if (isdup) {
       if ( options.expunge_duplicates ) {
         char seq[30];
         sprintf( seq, "%lu", msgno);
         if (! options.simulate )
-          if ( msgid.empty() )
+          if ( msgid.empty() || msgid.is_content_msgid() )
             fprintf( stderr, "Not deleting duplicate message with empty "
                              "Message-ID - see README");
           else
-            remove_set.insert( msgid );
+            remove_set.insert( handle );
             // mail_setflag( this->stream, seq, "\\Deleted" );
       }
       nduplicates++;
@@ -263,16 +408,121 @@ bool Store::fetch_message_ids(MsgIdPositions& mids, MsgIdSet& remove_set)
     }
     else
     {
-      mids.insert(make_pair(msgid, msgno));
+      mids.insert(make_pair(handle, msgno));
+      digest.add( msgid_table.hash( handle ));
+      if ( uids )
+        uids_now.add( uid, handle );
     }
     if ( isdup && options.show_from )
     {
       print_from( this->stream, msgno );
-      if ( options.show_message_id ) print_msgid( msgid.c_str() );
+      if ( options.show_message_id )
+        print_msgid( msgid.printable().c_str() );
+      printf("\n");
+    }
+  }
+
+  if ( uids ) {
+    if (options.debug)
+      printf( " %lu of %lu message id's were known by their UIDs\n",
+              ncached, n );
+    if ( nabsent == 0 && nduplicates == 0 )
+      uids_now.uid_last = this->stream->uid_last;
+    *uids = uids_now;
+  }
+  print_duplicates_summary( nduplicates );
+  return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool Store::fetch_message_ids(SpilledIds& mids, SpilledIds& remove_set,
+                              SetDigest& digest)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  IDENTITY_DISPATCH( fetch_message_ids_as, ( mids, remove_set, digest))
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+template <class Identity>
+bool Store::fetch_message_ids_as(SpilledIds& mids, SpilledIds& remove_set,
+                                 SetDigest& digest)
+//
+// Same as above, but the message ids are spilled to disk - see
+// --max-memory
+//
+// Of duplicates the first message is kept and the later ones are added
+// to remove_set
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  unsigned long n = this->stream->nmsgs;
+  unsigned long nduplicates = 0;
+
+  if (options.debug) {
+    printf( " Fetching message id's in mailbox \"%s\" out of core\n", 
+            this->stream->mailbox);
+  }
+
+  for (unsigned long msgno=1; msgno<=n; msgno++) {
+    MsgId msgid;
+    ENVELOPE *envelope;
+
+    envelope = mail_fetchenvelope( this->stream, msgno);
+    if (! envelope) {
+      fprintf( stderr,
+               "Error: Couldn't fetch enveloppe #%lu from mailbox box %s\n",
+               msgno, this->stream->mailbox);
+      fprintf( stderr, "       Aborting!\n");
+      return 0;
+    }
+    msgid = Identity::from_message( this->stream, msgno, envelope);
+    if (msgid.length() == 0) {
+      print_lead("no msg-id", "");
+      // Absent message-id.  Don't touch message.
+      continue;
+    }
+    mids.add( msgid, msgno );
+    digest.add( hash_msgid( msgid.data(), msgid.length() ));
+  }
+
+  SpilledIds duplicates( 0 );
+  if (! mids.finish( &duplicates ))
+    return 0;
+
+  for (SpilledIds::Cursor i( duplicates ); ! i.done(); i.next()) {
+    MsgId msgid( i.key() );
+    digest.remove( hash_msgid( msgid.data(), msgid.length() ));
+    if ( options.expunge_duplicates && ! options.simulate ) {
+      if ( msgid.empty() || msgid.is_content_msgid() )
+        fprintf( stderr, "Not deleting duplicate message with empty "
+                         "Message-ID - see README");
+      else
+        remove_set.append( msgid, i.msgno() );
+    }
+    nduplicates++;
+    if ( options.show_from )
+    {
+      print_lead( "duplicate", "");
+      print_from( this->stream, i.msgno() );
+      if ( options.show_message_id )
+        print_msgid( msgid.printable().c_str() );
       printf("\n");
     }
   }
 
+  print_duplicates_summary( nduplicates );
+  return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void Store::print_duplicates_summary( unsigned long nduplicates )
+//
+//////////////////////////////////////////////////////////////////////////
+{
   if (nduplicates)
   {
     if (options.show_summary)
@@ -292,7 +542,6 @@ bool Store::fetch_message_ids(MsgIdPositions& mids, MsgIdSet& remove_set)
     }
     fflush(stdout);
   }
-  return 1;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -332,18 +581,20 @@ bool Store::list_contents()
                "       Aborting!\n");
       return 0;
     }
-    msgid = MsgId(envelope);
+    msgid = MsgId( this->stream, msgno, envelope);
     if (msgid.length() == 0)
       print_lead( "no msg-id", "");
     else
     {
-      isdup = mids.count( msgid );
+      MsgIdHandle handle = msgid_table.intern( msgid );
+      isdup = mids.count( handle );
       if (isdup)
         print_lead( "duplicate", "");
       else
-        mids.insert( make_pair(msgid, msgno));
+        mids.insert( make_pair(handle, msgno));
     
-      if ( options.show_message_id ) print_msgid( msgid.c_str() );
+      if ( options.show_message_id )
+        print_msgid( msgid.printable().c_str() );
     }
     print_from( this->stream, msgno );
     printf( "\n");
@@ -373,7 +624,7 @@ bool Store::flag_message_for_removal( unsigned long msgno,
              msgno, this->stream->mailbox);
     return 0;
   }
-  msgid_fetched = MsgId(envelope);
+  msgid_fetched = MsgId( this->stream, msgno, envelope);
   if (msgid_fetched.length() == 0) {
     printf( "Error: no message-id, so I won't delete the message.\n" );
     // Possibly indicates concurrent access?
@@ -385,7 +636,7 @@ bool Store::flag_message_for_removal( unsigned long msgno,
     {
       printf( "Error: message-ids %s and %s don't match, "
               "so I won't delete the message.\n",
-              msgid_fetched.c_str(), msgid.c_str() );
+              msgid_fetched.printable().c_str(), msgid.printable().c_str() );
       success = 0;
     }
   }
@@ -7,6 +7,9 @@
 #include "c-client-header.h"
 #include "types.h"
 #include "msgid.h"
+#include "spill.h"
+#include "set_digest.h"
+#include "uid_cache.h"
 
 //////////////////////////////////////////////////////////////////////////
 //
@@ -36,18 +39,33 @@ class Store
     size_t acquire_mail_list( );
     void get_delim();
     string full_mailbox_name(const string& box);
-    bool fetch_message_ids(MsgIdPositions& mids, MsgIdSet& remove_set);
+    bool fetch_message_ids(MsgIdPositions& mids, MsgIdSet& remove_set,
+                           SetDigest& digest, UidCache* uids = NULL);
+    bool fetch_message_ids(SpilledIds& mids, SpilledIds& remove_set,
+                           SetDigest& digest);
+    void print_duplicates_summary( unsigned long nduplicates );
     bool list_contents();
     bool flag_message_for_removal( unsigned long msgno, const MsgId& msgid,
                                    char * place);
     MAILSTREAM* mailbox_open( const string& boxname,
                                      long c_client_options);
     MAILSTREAM* store_open( long c_client_options);
+    bool mailbox_status( const string& boxname, MAILSTATUS& status);
     bool mailbox_create( const string& boxname );
+    bool mailbox_rename( const string& from, const string& to );
+    bool messages_copy( const string& sequence, const string& to );
     char* driver_name();
     void display_driver();
     void print_error(const char * cause, const string& mailbox);
     int mailbox_expunge(string mailbox_name);
+
+  private:
+    template <class Identity>
+    bool fetch_message_ids_as(MsgIdPositions& mids, MsgIdSet& remove_set,
+                              SetDigest& digest, UidCache* uids);
+    template <class Identity>
+    bool fetch_message_ids_as(SpilledIds& mids, SpilledIds& remove_set,
+                              SetDigest& digest);
 };
 
 #define __MAILSYNC_STORE__
@@ -6,6 +6,7 @@
 #include <set>
 #include "c-client-header.h"
 #include "msgid.h"
+#include "msgid_table.h"
 
 using namespace std;
 
@@ -40,8 +41,10 @@ struct longer
 };
 
 typedef map<string, MailboxProperties, longer> MailboxMap;
-typedef set<MsgId>  MsgIdSet;
-typedef map<MsgId, unsigned long> MsgIdPositions;  // Map message ids to
+typedef set<MsgIdHandle>  MsgIdSet;                 // Interned message ids,
+                                                    // see msgid_table.h
+typedef map<MsgIdHandle, unsigned long> MsgIdPositions;
+                                                    // Map message ids to
                                                     // positions within a
                                                     // mailbox
 typedef map<string, MsgIdSet> MsgIdsPerMailbox;     // A List of message ids
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <map>
+#include <vector>
+#include "uid_cache.h"
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool UidCache::lookup( unsigned long uid, MsgIdHandle& handle) const
+//
+// Get the message id of "uid", if it's known
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  map<unsigned long, MsgIdHandle>::const_iterator i = ids.find( uid );
+  if ( i == ids.end() )
+    return false;
+  handle = i->second;
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool UidCache::covers( unsigned long uid_validity, unsigned long now_uid_last,
+                       unsigned long nmsgs, vector<MsgIdHandle>& handles) const
+//
+// Say whether a mailbox with "nmsgs" messages, whose UIDVALIDITY and last
+// assigned UID are "uid_validity" and "now_uid_last", still holds exactly
+// the cached messages. No message can have been added then and as many
+// messages as the cache held when it was made are left, so none has been
+// expunged either.
+//
+// If so "handles" gets the message ids in the order of the UIDs, which is
+// the order of the message numbers.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( ! uid_last || uid_validity != uidvalidity
+       || now_uid_last != uid_last || nmsgs != ids.size() )
+    return false;
+  handles.clear();
+  handles.reserve( ids.size() );
+  for ( map<unsigned long, MsgIdHandle>::const_iterator i = ids.begin();
+        i != ids.end(); i++ )
+    handles.push_back( i->second );
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+string UidCache::to_string() const
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  char buf[60];
+  sprintf( buf, "%lu %lu", uidvalidity, uid_last );
+  string s = buf;
+  unsigned long last = 0;
+  for ( map<unsigned long, MsgIdHandle>::const_iterator i = ids.begin();
+        i != ids.end(); i++ ) {
+    sprintf( buf, " %lx:%llx", i->first - last,
+             (unsigned long long) msgid_table.hash( i->second ) );
+    s += buf;
+    last = i->first;
+  }
+  return s;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool UidCache::from_string( const string& s, unsigned long uid_validity,
+                            const MsgIdSet& known)
+//
+// Read the cache of a mailbox whose UIDVALIDITY is "uid_validity" now.
+// Only the UIDs of message ids in "known" are taken - if any other is
+// dropped, the cache no longer holds every message and uid_last is 0.
+//
+// Returns false if the cache is unusable, because the UIDVALIDITY has
+// changed or it's garbled
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  uidvalidity = uid_validity;
+  uid_last = 0;
+  ids.clear();
+  const char* p = s.c_str();
+  char* end;
+  if ( strtoul( p, &end, 10 ) != uid_validity || end == p )
+    return false;
+  p = end;
+  unsigned long cached_uid_last = strtoul( p, &end, 10 );
+  if ( end == p || ( *end != ' ' && *end ) )
+    return false;
+
+  map<uint64_t, MsgIdHandle> by_hash;
+  for ( MsgIdSet::const_iterator i = known.begin(); i != known.end(); i++ )
+    by_hash[ msgid_table.hash( *i ) ] = *i;
+
+  unsigned long uid = 0;
+  bool dropped = false;
+  for ( p = end; *p == ' '; p = end ) {
+    uid += strtoul( p + 1, &end, 16 );
+    if ( *end != ':' ) {
+      ids.clear();
+      return false;
+    }
+    uint64_t hash = strtoull( end + 1, &end, 16 );
+    map<uint64_t, MsgIdHandle>::iterator i = by_hash.find( hash );
+    if ( i != by_hash.end() )
+      ids[uid] = i->second;
+    else
+      dropped = true;
+  }
+  if ( *p ) {
+    ids.clear();
+    return false;
+  }
+  if ( ! dropped )
+    uid_last = cached_uid_last;
+  return true;
+}
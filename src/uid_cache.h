@@ -0,0 +1,65 @@
+#ifndef __MAILSYNC_UID_CACHE__
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include "types.h"
+#include "msgid_table.h"
+
+using namespace std;
+
+#define UID_CACHE_MAX_MESSAGES 250000
+
+//////////////////////////////////////////////////////////////////////////
+//
+class UidCache
+//
+// The message ids of the messages in a remote IMAP mailbox by their UIDs
+//
+// A UID always stands for the same message as long as the UIDVALIDITY of
+// the mailbox stays the same. So once the message id of a UID is known
+// only the UIDs need to be fetched - one small FETCH per thousand
+// messages in c-client - and the envelopes of the messages that are new
+// since. Messages that are gone simply don't show up among the UIDs.
+//
+// If no UID has been assigned since and the mailbox has as many messages
+// as the cache, the messages are exactly the cached ones and not even the
+// UIDs need to be fetched - see covers().
+//
+// Stored in msinfo as
+// "<>, uids_a: <uidvalidity> <uid_last> <uid>:<hash> ..." - the UIDs as
+// differences to the one before and the hash_msgid()s of the ids, both in
+// hex. The hashes are resolved with the message ids msinfo holds for the
+// mailbox, messages whose id isn't among them are fetched again.
+//
+// That's about 19 bytes per message and store on one msinfo line, which
+// is rewritten on every run like the rest of msinfo - some 2 MB per store
+// for a mailbox of 100000 messages, less than its message ids take.
+// Mailboxes of more than UID_CACHE_MAX_MESSAGES messages are not cached.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    UidCache(): uidvalidity(0), uid_last(0), ids() {}
+
+    bool lookup( unsigned long uid, MsgIdHandle& handle) const;
+    void add( unsigned long uid, MsgIdHandle handle) { ids[uid] = handle; }
+    unsigned long size() const { return ids.size(); }
+    bool covers( unsigned long uid_validity, unsigned long now_uid_last,
+                 unsigned long nmsgs, vector<MsgIdHandle>& handles) const;
+
+    string to_string() const;
+    bool from_string( const string& s, unsigned long uid_validity,
+                      const MsgIdSet& known);
+
+    unsigned long uidvalidity;
+    unsigned long uid_last;     // 0 unless the cache held every message
+                                // up to this UID when it was made
+
+  private:
+    map<unsigned long, MsgIdHandle> ids;
+};
+
+#define __MAILSYNC_UID_CACHE__
+#endif
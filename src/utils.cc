@@ -1,6 +1,11 @@
+#include "config.h"
 #include <stdio.h>
 #include <ctype.h>
+#ifdef HAVE_PTHREAD
+ #include <pthread.h>
+#endif
 #include <string>
+#include <vector>
 #include "utils.h"
 
 //////////////////////////////////////////////////////////////////////////
@@ -34,3 +39,29 @@ char* nccs( const string& s)
   return (char*) s.c_str();
 }
 
+
+//////////////////////////////////////////////////////////////////////////
+//
+void run_in_threads( void* (*work)(void*), const vector<void*>& jobs)
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( jobs.empty() )
+    return;
+#ifdef HAVE_PTHREAD
+  vector<pthread_t> threads( jobs.size() );
+  vector<bool> started( jobs.size(), false );
+  for ( unsigned t = 1; t < jobs.size(); t++ )
+    started[t] = pthread_create( &threads[t], NULL, work, jobs[t] ) == 0;
+  work( jobs[0] );
+  // jobs whose thread couldn't be started are done here
+  for ( unsigned t = 1; t < jobs.size(); t++ )
+    if ( started[t] )
+      pthread_join( threads[t], NULL );
+    else
+      work( jobs[t] );
+#else
+  for ( unsigned t = 0; t < jobs.size(); t++ )
+    work( jobs[t] );
+#endif // HAVE_PTHREAD
+}
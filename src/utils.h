@@ -1,11 +1,22 @@
 #ifndef __MAILSYNC_UTILS__
 #include <stdio.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
 void print_with_escapes( FILE* f, const string& str);
 char* nccs( const string& s);
 
+//////////////////////////////////////////////////////////////////////////
+//
+void run_in_threads( void* (*work)(void*), const vector<void*>& jobs);
+//
+// Run "work" on each of "jobs", each in a thread of its own if pthreads
+// are available, and wait for all of them. The calling thread takes the
+// first job.
+//
+//////////////////////////////////////////////////////////////////////////
+
 #define __MAILSYNC_UTILS__
 #endif
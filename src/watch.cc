@@ -0,0 +1,454 @@
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#ifdef HAVE_SYS_INOTIFY_H
+ #include <sys/inotify.h>
+#endif
+#include <string>
+#include <set>
+#include <map>
+#include "watch.h"
+#include "native_scan.h"
+#include "options.h"
+#include "utils.h"
+#include <imap4r1.h>                    // imap_send
+
+extern options_t options;
+extern Passwd* current_context_passwd;
+
+RemoteWatcher* polling_watcher = NULL;
+
+#ifdef HAVE_SYS_INOTIFY_H
+// Whatever adds, removes or rewrites messages
+#define WATCH_EVENTS ( IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+                       | IN_MOVED_FROM | IN_MOVED_TO )
+#endif // HAVE_SYS_INOTIFY_H
+
+//////////////////////////////////////////////////////////////////////////
+//
+MailboxWatcher::MailboxWatcher()
+//
+//////////////////////////////////////////////////////////////////////////
+  : fd( -1 ), watched(), all(), listing(), listing_changed( false )
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  fd = inotify_init();
+  if ( fd < 0 )
+    fprintf( stderr, "Error: Couldn't initialize inotify: %s\n",
+                     strerror(errno) );
+#endif // HAVE_SYS_INOTIFY_H
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+MailboxWatcher::~MailboxWatcher()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( fd >= 0 )
+    close( fd );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MailboxWatcher::add_watch( const string& dir, const string& file,
+                                const string& mailbox)
+//
+// Watch "dir" for changes to "file", or to any of its entries if "file"
+// is ""
+//
+//////////////////////////////////////////////////////////////////////////
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  // watching a directory again just gives its watch descriptor again
+  int wd = inotify_add_watch( fd, dir.c_str(), WATCH_EVENTS );
+  if ( wd < 0 ) {
+    fprintf( stderr, "Error: Couldn't watch %s: %s\n", dir.c_str(),
+                     strerror(errno) );
+    return false;
+  }
+  watched[wd][file] = mailbox;
+  all.insert( mailbox );
+  return true;
+#else
+  return false;
+#endif // HAVE_SYS_INOTIFY_H
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MailboxWatcher::watch( const string& mailbox, const string& path)
+//
+// Watch the maildir or mbox file "path" that holds "mailbox". Watching a
+// mailbox again does no harm.
+//
+// Returns false if it's neither or can't be watched
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( fd < 0 )
+    return false;
+  if ( is_maildir( path ) )
+    return add_watch( path + "/new", "", mailbox )
+           && add_watch( path + "/cur", "", mailbox );
+  if ( is_mbox( path ) ) {
+    string::size_type slash = path.rfind( '/' );
+    if ( slash == string::npos )
+      return false;
+    return add_watch( slash ? path.substr( 0, slash ) : "/",
+                      path.substr( slash + 1 ), mailbox );
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MailboxWatcher::watch_listing( const string& dir)
+//
+// Watch "dir" for entries that are added or removed, which may be
+// maildirs or mbox files being created, deleted or renamed. Watching a
+// directory again does no harm.
+//
+// Returns false if it can't be watched, e.g. because it doesn't exist
+//
+//////////////////////////////////////////////////////////////////////////
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  if ( fd < 0 )
+    return false;
+  int wd = inotify_add_watch( fd, dir.c_str(), WATCH_EVENTS );
+  if ( wd < 0 )
+    return false;
+  listing.insert( wd );
+  return true;
+#else
+  return false;
+#endif // HAVE_SYS_INOTIFY_H
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MailboxWatcher::entries_changed()
+//
+// Say whether entries were added to or removed from a directory watched
+// with watch_listing() since the last time that was asked
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  bool changed = listing_changed;
+  listing_changed = false;
+  return changed;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MailboxWatcher::read_events( set<string>& changed)
+//
+// Read the pending events and add the mailboxes they concern to
+// "changed"
+//
+// Returns false if reading failed
+//
+//////////////////////////////////////////////////////////////////////////
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  char buf[4096]
+       __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len = read( fd, buf, sizeof(buf) );
+  if ( len < 0 )
+    return errno == EINTR || errno == EAGAIN;
+
+  for ( char* p = buf; p < buf + len; ) {
+    struct inotify_event* event = (struct inotify_event*) p;
+    p += sizeof(struct inotify_event) + event->len;
+
+    // events were lost, so anything may have changed
+    if ( event->mask & IN_Q_OVERFLOW ) {
+      changed.insert( all.begin(), all.end() );
+      listing_changed = true;
+      continue;
+    }
+    if ( listing.count( event->wd ) ) {
+      if ( event->mask & ( IN_CREATE | IN_MOVED_TO | IN_DELETE
+                           | IN_MOVED_FROM ) )
+        listing_changed = true;
+      if ( event->mask & IN_IGNORED )
+        listing.erase( event->wd );
+    }
+    map<int, map<string, string> >::iterator w = watched.find( event->wd );
+    if ( w == watched.end() )
+      continue;
+    map<string, string>::iterator m = w->second.find( "" );
+    if ( m == w->second.end() && event->len )
+      m = w->second.find( event->name );
+    if ( m != w->second.end() )
+      changed.insert( m->second );
+    // the directory is gone, the mailboxes in it have changed for sure
+    if ( event->mask & IN_IGNORED ) {
+      for ( m = w->second.begin(); m != w->second.end(); m++ )
+        changed.insert( m->second );
+      watched.erase( w );
+    }
+  }
+  return true;
+#else
+  return false;
+#endif // HAVE_SYS_INOTIFY_H
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool MailboxWatcher::wait( int timeout, set<string>& changed)
+//
+// Wait up to "timeout" seconds for watched mailboxes to change. Once they
+// do, events keep being collected until there are none for
+// WATCH_QUIET_SECONDS - a delivery or a MUA expunging a mailbox come as a
+// burst of events - but no longer than WATCH_MAX_DELAY_SECONDS.
+//
+// Returns false if nothing changed in time - without inotify it just
+// waits. Else "changed" holds the names of the mailboxes that did, or
+// entries_changed() says that mailboxes may have come or gone.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  changed.clear();
+  if ( fd < 0 ) {
+    sleep( timeout );
+    return false;
+  }
+  struct pollfd p;
+  p.fd = fd;
+  p.events = POLLIN;
+  if ( poll( &p, 1, timeout * 1000 ) <= 0 )
+    return false;
+
+  time_t start = time( NULL );
+  bool ok = read_events( changed );
+  while ( ok && time( NULL ) - start < WATCH_MAX_DELAY_SECONDS
+          && poll( &p, 1, WATCH_QUIET_SECONDS * 1000 ) > 0 )
+    ok = read_events( changed );
+  if (! ok )
+    fprintf( stderr, "Error: Couldn't read inotify events: %s\n",
+                     strerror(errno) );
+  return ! changed.empty() || listing_changed;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+RemoteWatcher::RemoteWatcher( Store& remote)
+//
+//////////////////////////////////////////////////////////////////////////
+  : store( remote ), stream( NIL ), notify( false ), next_poll( 0 ),
+    names(), last(), changed( NULL )
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+RemoteWatcher::~RemoteWatcher()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( stream )
+    mail_close( stream );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool RemoteWatcher::start()
+//
+// Connect to the server and subscribe to its notifications if it can
+// send them, else take down the status of all mailboxes
+//
+// Returns false if the server can't be reached
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  names.clear();
+  for ( MailboxMap::iterator box = store.boxes.begin();
+        box != store.boxes.end(); box++ )
+    if (! box->second.no_select )
+      watch( box->first );
+
+  current_context_passwd = &store.passwd;
+  stream = mail_open( NIL, nccs( store.server ),
+                      OP_HALFOPEN | OP_READONLY
+                      | ( options.debug_imap ? OP_DEBUG : 0 ) );
+  if (! stream ) {
+    fprintf( stderr, "Error: Can't contact server %s\n",
+                     store.server.c_str() );
+    return false;
+  }
+  notify = subscribe();
+  if ( options.debug )
+    printf( " Watching %s %s\n", store.name.c_str(),
+            notify ? "with NOTIFY" : "by asking for the status of mailboxes" );
+
+  if (! notify )
+    ask_status();
+  next_poll = time( NULL ) + interval();
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void RemoteWatcher::watch( const string& mailbox)
+//
+// Watch "mailbox" too. NOTIFY covers all mailboxes of the store anyway.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  names[ store.full_mailbox_name( mailbox ).substr(
+                                       store.server.length() ) ] = mailbox;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void RemoteWatcher::unwatch( const string& mailbox)
+//
+// Stop asking for the status of "mailbox", it's gone
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  names.erase( store.full_mailbox_name( mailbox ).substr(
+                                                 store.server.length() ) );
+  last.erase( mailbox );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool RemoteWatcher::subscribe()
+//
+// Ask an IMAP server to notify us of new and expunged messages in the
+// mailboxes of the store. Flag changes don't matter, mailsync doesn't
+// sync flags.
+//
+// Returns false if the server doesn't support NOTIFY
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  if ( strcmp( stream->dtb->name, "imap" ) != 0 )
+    return false;
+
+  string mailboxes = "personal";
+  string prefix = store.prefix;
+  if (! prefix.empty() && prefix[ prefix.length() - 1 ] == (char) store.delim)
+    prefix.erase( prefix.length() - 1 );
+  if (! prefix.empty() ) {
+    mailboxes = "subtree \"";
+    for ( string::size_type i = 0; i < prefix.length(); i++ ) {
+      if ( prefix[i] == '"' || prefix[i] == '\\' )
+        mailboxes += '\\';
+      mailboxes += prefix[i];
+    }
+    mailboxes += '"';
+  }
+  string command = "NOTIFY SET (" + mailboxes
+                   + " (MessageNew MessageExpunge))";
+  IMAPPARSEDREPLY* reply = imap_send( stream, nccs( command ), NIL );
+  return reply && reply->key && strcmp( (char*) reply->key, "OK" ) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void RemoteWatcher::ask_status()
+//
+// Ask for the status of every mailbox, the answers go to status()
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  RemoteWatcher* outer = polling_watcher;
+  polling_watcher = this;
+  for ( map<string, string>::iterator name = names.begin();
+        name != names.end(); name++ )
+    mail_status( stream, nccs( store.server + name->first ),
+                 SA_MESSAGES | SA_UIDNEXT | SA_UIDVALIDITY );
+  polling_watcher = outer;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+int RemoteWatcher::interval() const
+//
+// Seconds after which poll() is due again
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  return notify ? WATCH_NOTIFY_SECONDS : WATCH_STATUS_SECONDS;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+bool RemoteWatcher::poll( set<string>& changed_boxes)
+//
+// If it's time to, add the mailboxes that changed since the last poll to
+// "changed_boxes". If the connection was lost it's opened again, and all
+// mailboxes are taken to have changed.
+//
+// Returns false if the server can't be reached
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  time_t now = time( NULL );
+  if ( now < next_poll )
+    return true;
+  next_poll = now + interval();
+  if (! stream && ! start() )
+    return false;
+
+  current_context_passwd = &store.passwd;
+  polling_watcher = this;
+  changed = &changed_boxes;
+  bool alive = mail_ping( stream );
+  if ( alive && ! notify )
+    ask_status();
+  polling_watcher = NULL;
+  changed = NULL;
+
+  if (! alive ) {
+    stream = mail_close( stream );
+    if (! start() )
+      return false;
+    for ( map<string, string>::iterator name = names.begin();
+          name != names.end(); name++ )
+      changed_boxes.insert( name->second );
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+void RemoteWatcher::status( const char* mailbox, MAILSTATUS* status)
+//
+// The status of "mailbox", as told by the server. With NOTIFY it is sent
+// because the mailbox changed, else it's compared with the last one.
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  const char* name = strchr( mailbox, '}' );
+  name = name ? name + 1 : mailbox;
+  map<string, string>::iterator box = names.find( name );
+  if ( box == names.end() )
+    return;
+  if ( notify ) {
+    if ( changed )
+      changed->insert( box->second );
+    return;
+  }
+
+  Status now;
+  now.messages = status->flags & SA_MESSAGES ? status->messages : 0;
+  now.uidnext = status->flags & SA_UIDNEXT ? status->uidnext : 0;
+  now.uidvalidity = status->flags & SA_UIDVALIDITY ? status->uidvalidity : 0;
+  map<string, Status>::iterator before = last.find( box->second );
+  if ( changed && before != last.end()
+       && ( before->second.messages != now.messages
+            || before->second.uidnext != now.uidnext
+            || before->second.uidvalidity != now.uidvalidity ) )
+    changed->insert( box->second );
+  last[ box->second ] = now;
+}
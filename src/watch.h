@@ -0,0 +1,120 @@
+#ifndef __MAILSYNC_WATCH__
+
+#include <time.h>
+#include <string>
+#include <set>
+#include <map>
+#include "c-client-header.h"
+#include "store.h"
+
+using namespace std;
+
+// Seconds without further events after which a burst of changes is over
+#define WATCH_QUIET_SECONDS 2
+// ... but a burst isn't waited out for longer than that
+#define WATCH_MAX_DELAY_SECONDS 10
+
+// Seconds between collecting the notifications of an IMAP server
+#define WATCH_NOTIFY_SECONDS 15
+// Seconds between asking for the status of every mailbox of a server
+// without NOTIFY
+#define WATCH_STATUS_SECONDS 60
+
+//////////////////////////////////////////////////////////////////////////
+//
+class MailboxWatcher
+//
+// Waits for changes to local maildirs and mbox files with inotify, for
+// --watch
+//
+// For a maildir its new/ and cur/ directories are watched, for an mbox
+// file the directory it is in - mbox files are often replaced rather than
+// rewritten. Events are only available if mailsync was built with
+// sys/inotify.h.
+//
+// Directories mailboxes may show up in or vanish from are watched as
+// well, see watch_listing().
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    MailboxWatcher();
+    ~MailboxWatcher();
+
+    bool available() const { return fd >= 0; }
+    bool watch( const string& mailbox, const string& path);
+    bool watch_listing( const string& dir);
+    bool wait( int timeout, set<string>& changed);
+    bool entries_changed();
+
+  private:
+    int fd;                             // the inotify instance
+    // what a watch descriptor stands for: the mailboxes it covers by the
+    // name of the file they're in, "" for all of the directory
+    map<int, map<string, string> > watched;
+    set<string> all;                    // every watched mailbox
+    set<int> listing;                   // directories watched for
+                                        // mailboxes coming and going
+    bool listing_changed;
+
+    bool add_watch( const string& dir, const string& file,
+                    const string& mailbox);
+    bool read_events( set<string>& changed);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+class RemoteWatcher
+//
+// Notices changes to the mailboxes of a remote store, for --watch
+//
+// It has a connection of its own. If the server supports NOTIFY (RFC
+// 5465) that subscribes to new and expunged messages in all mailboxes of
+// the store, so a single connection covers all of them. The server
+// reports changes as untagged STATUS responses, which c-client hands to
+// mm_status(). c-client only reads them while a command is running, so
+// they're collected with a NOOP every WATCH_NOTIFY_SECONDS.
+//
+// Without NOTIFY the status of every mailbox - the number of messages,
+// UIDNEXT and UIDVALIDITY - is asked for every WATCH_STATUS_SECONDS and
+// compared with the one before.
+//
+// Mailboxes the store gets later on are to be added with watch(), the
+// ones it loses removed with unwatch().
+//
+//////////////////////////////////////////////////////////////////////////
+{
+  public:
+    RemoteWatcher( Store& store);
+    ~RemoteWatcher();
+
+    bool start();
+    void watch( const string& mailbox);
+    void unwatch( const string& mailbox);
+    int interval() const;
+    bool poll( set<string>& changed);
+    void status( const char* mailbox, MAILSTATUS* status);
+
+  private:
+    struct Status
+    {
+      unsigned long messages, uidnext, uidvalidity;
+    };
+
+    Store& store;
+    MAILSTREAM* stream;                 // the connection of its own
+    bool notify;                        // the server sends notifications
+    time_t next_poll;
+    map<string, string> names;          // server name -> mailbox
+    map<string, Status> last;           // by mailbox, without NOTIFY
+    set<string>* changed;               // while polling
+
+    bool subscribe();
+    void ask_status();
+};
+
+// The RemoteWatcher that is polling, mm_status() passes the status on
+extern RemoteWatcher* polling_watcher;
+
+#define __MAILSYNC_WATCH__
+#endif